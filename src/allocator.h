@@ -0,0 +1,80 @@
+#ifndef __LIBXI_ALLOCATOR_H__
+#define __LIBXI_ALLOCATOR_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "xi.h"
+
+/**
+ * Allocation helpers shared by libxi sources, every allocation of libxi goes through these.
+ * Not part of the public API.
+ */
+
+static inline void*
+xi_default_alloc(const size_t size, void *userdata)
+{
+   (void)userdata;
+   return malloc(size);
+}
+
+static inline void*
+xi_default_realloc(void *ptr, const size_t size, void *userdata)
+{
+   (void)userdata;
+   return realloc(ptr, size);
+}
+
+static inline void
+xi_default_free(void *ptr, void *userdata)
+{
+   (void)userdata;
+   free(ptr);
+}
+
+static const struct xi_allocator xi_default_allocator = {
+   .alloc = xi_default_alloc,
+   .realloc = xi_default_realloc,
+   .free = xi_default_free,
+};
+
+static inline void*
+xi_alloc(const struct xi_allocator *allocator, const size_t size)
+{
+   assert(allocator);
+   return allocator->alloc(size, allocator->userdata);
+}
+
+static inline void*
+xi_calloc(const struct xi_allocator *allocator, const size_t nmemb, const size_t size)
+{
+   assert(allocator);
+
+   if (size && nmemb > SIZE_MAX / size)
+      return NULL;
+
+   void *ptr;
+   if ((ptr = xi_alloc(allocator, nmemb * size)))
+      memset(ptr, 0, nmemb * size);
+
+   return ptr;
+}
+
+static inline void*
+xi_realloc(const struct xi_allocator *allocator, void *ptr, const size_t size)
+{
+   assert(allocator);
+   return (ptr ? allocator->realloc(ptr, size, allocator->userdata) : xi_alloc(allocator, size));
+}
+
+static inline void
+xi_free(const struct xi_allocator *allocator, void *ptr)
+{
+   assert(allocator);
+
+   if (ptr)
+      allocator->free(ptr, allocator->userdata);
+}
+
+#endif /* __LIBXI_ALLOCATOR_H__ */
@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "xi.h"
+#include "allocator.h"
+
+struct xi_cache_entry {
+   char *key;
+   struct xi_archive *archive;
+   size_t size, refs;
+   bool loading, stale;
+
+   // key bucket, archive bucket and lru links
+   struct xi_cache_entry *next_key, *next_archive;
+   struct xi_cache_entry *lru_prev, *lru_next;
+};
+
+struct xi_cache {
+   struct xi_allocator allocator;
+   pthread_mutex_t mutex;
+   pthread_cond_t loaded;
+
+   struct xi_cache_entry **keys, **archives;
+   size_t buckets, entries;
+
+   // most recently used first, only unreferenced entries are evicted
+   struct xi_cache_entry *lru_head, *lru_tail;
+
+   struct xi_cache_stats stats;
+   struct xi_load_options options;
+   char *root;
+};
+
+static size_t
+hash_key(const char *key)
+{
+   // FNV-1a
+   size_t hash = 2166136261u;
+   for (; *key; ++key)
+      hash = (hash ^ (uint8_t)*key) * 16777619u;
+   return hash;
+}
+
+static size_t
+hash_pointer(const void *ptr)
+{
+   const uintptr_t p = (uintptr_t)ptr;
+   return (p >> 4) ^ (p >> 12);
+}
+
+static char*
+string_dup(const struct xi_allocator *allocator, const char *string)
+{
+   assert(allocator && string);
+
+   char *copy;
+   const size_t length = strlen(string);
+   if (!(copy = xi_alloc(allocator, length + 1)))
+      return NULL;
+
+   memcpy(copy, string, length + 1);
+   return copy;
+}
+
+static struct xi_cache_entry*
+cache_find_key(struct xi_cache *cache, const char *key)
+{
+   assert(cache && key);
+
+   struct xi_cache_entry *e = cache->keys[hash_key(key) & (cache->buckets - 1)];
+   for (; e && strcmp(e->key, key); e = e->next_key);
+   return e;
+}
+
+static struct xi_cache_entry*
+cache_find_archive(struct xi_cache *cache, const struct xi_archive *archive)
+{
+   assert(cache && archive);
+
+   struct xi_cache_entry *e = cache->archives[hash_pointer(archive) & (cache->buckets - 1)];
+   for (; e && e->archive != archive; e = e->next_archive);
+   return e;
+}
+
+static void
+cache_unlink_key(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry);
+
+   struct xi_cache_entry **e = &cache->keys[hash_key(entry->key) & (cache->buckets - 1)];
+   for (; *e && *e != entry; e = &(*e)->next_key);
+
+   if (*e)
+      *e = entry->next_key;
+
+   entry->next_key = NULL;
+}
+
+static void
+cache_link_archive(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry && entry->archive);
+
+   struct xi_cache_entry **bucket = &cache->archives[hash_pointer(entry->archive) & (cache->buckets - 1)];
+   entry->next_archive = *bucket;
+   *bucket = entry;
+}
+
+static void
+cache_unlink_archive(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry && entry->archive);
+
+   struct xi_cache_entry **e = &cache->archives[hash_pointer(entry->archive) & (cache->buckets - 1)];
+   for (; *e && *e != entry; e = &(*e)->next_archive);
+
+   if (*e)
+      *e = entry->next_archive;
+
+   entry->next_archive = NULL;
+}
+
+static void
+lru_remove(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry);
+
+   if (entry->lru_prev)
+      entry->lru_prev->lru_next = entry->lru_next;
+   else if (cache->lru_head == entry)
+      cache->lru_head = entry->lru_next;
+
+   if (entry->lru_next)
+      entry->lru_next->lru_prev = entry->lru_prev;
+   else if (cache->lru_tail == entry)
+      cache->lru_tail = entry->lru_prev;
+
+   entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push_front(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry);
+
+   entry->lru_prev = NULL;
+   entry->lru_next = cache->lru_head;
+
+   if (cache->lru_head)
+      cache->lru_head->lru_prev = entry;
+   else
+      cache->lru_tail = entry;
+
+   cache->lru_head = entry;
+}
+
+static void
+entry_free(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry);
+
+   if (entry->archive)
+      xi_archive_free(entry->archive);
+
+   xi_free(&cache->allocator, entry->key);
+   xi_free(&cache->allocator, entry);
+}
+
+static void
+cache_drop(struct xi_cache *cache, struct xi_cache_entry *entry)
+{
+   assert(cache && entry && !entry->refs);
+
+   // stale entries are already unreachable by key
+   if (!entry->stale) {
+      cache_unlink_key(cache, entry);
+      lru_remove(cache, entry);
+   }
+
+   cache_unlink_archive(cache, entry);
+   cache->stats.bytes -= entry->size;
+   cache->stats.entries -= 1;
+   cache->entries -= 1;
+   entry_free(cache, entry);
+}
+
+static void
+cache_evict(struct xi_cache *cache)
+{
+   assert(cache);
+
+   struct xi_cache_entry *e = cache->lru_tail;
+   while (e && cache->stats.bytes > cache->stats.budget) {
+      struct xi_cache_entry *prev = e->lru_prev;
+
+      if (!e->refs) {
+         cache_drop(cache, e);
+         cache->stats.evictions += 1;
+      }
+
+      e = prev;
+   }
+}
+
+static bool
+cache_grow(struct xi_cache *cache)
+{
+   assert(cache);
+
+   if (cache->entries < cache->buckets)
+      return true;
+
+   struct xi_cache_entry **keys, **archives;
+   const size_t buckets = cache->buckets * 2;
+   if (!(keys = xi_calloc(&cache->allocator, buckets, sizeof(struct xi_cache_entry*))) ||
+       !(archives = xi_calloc(&cache->allocator, buckets, sizeof(struct xi_cache_entry*)))) {
+      xi_free(&cache->allocator, keys);
+      return false;
+   }
+
+   for (size_t b = 0; b < cache->buckets; ++b) {
+      for (struct xi_cache_entry *e = cache->keys[b], *next; e; e = next) {
+         next = e->next_key;
+         struct xi_cache_entry **bucket = &keys[hash_key(e->key) & (buckets - 1)];
+         e->next_key = *bucket;
+         *bucket = e;
+      }
+
+      for (struct xi_cache_entry *e = cache->archives[b], *next; e; e = next) {
+         next = e->next_archive;
+         struct xi_cache_entry **bucket = &archives[hash_pointer(e->archive) & (buckets - 1)];
+         e->next_archive = *bucket;
+         *bucket = e;
+      }
+   }
+
+   xi_free(&cache->allocator, cache->keys);
+   xi_free(&cache->allocator, cache->archives);
+   cache->keys = keys;
+   cache->archives = archives;
+   cache->buckets = buckets;
+   return true;
+}
+
+struct xi_cache*
+xi_cache_new(const size_t budget, const char *root, const struct xi_load_options *options)
+{
+   const struct xi_allocator *allocator = (options && options->allocator ? options->allocator : &xi_default_allocator);
+
+   struct xi_cache *cache;
+   if (!(cache = xi_calloc(allocator, 1, sizeof(struct xi_cache))))
+      goto fail;
+
+   cache->allocator = *allocator;
+   cache->buckets = 64;
+   if (!(cache->keys = xi_calloc(allocator, cache->buckets, sizeof(struct xi_cache_entry*))) ||
+       !(cache->archives = xi_calloc(allocator, cache->buckets, sizeof(struct xi_cache_entry*))))
+      goto fail;
+
+   if (root && !(cache->root = string_dup(allocator, root)))
+      goto fail;
+
+   if (pthread_mutex_init(&cache->mutex, NULL) != 0)
+      goto fail;
+
+   if (pthread_cond_init(&cache->loaded, NULL) != 0) {
+      pthread_mutex_destroy(&cache->mutex);
+      goto fail;
+   }
+
+   if (options)
+      cache->options = *options;
+
+   cache->stats.budget = budget;
+   return cache;
+
+fail:
+   if (cache) {
+      xi_free(allocator, cache->keys);
+      xi_free(allocator, cache->archives);
+      xi_free(allocator, cache->root);
+      xi_free(allocator, cache);
+   }
+   return NULL;
+}
+
+void
+xi_cache_free(struct xi_cache *cache)
+{
+   assert(cache);
+
+   // archives still referenced by callers are freed as well
+   for (size_t b = 0; b < cache->buckets; ++b) {
+      for (struct xi_cache_entry *e = cache->archives[b], *next; e; e = next) {
+         next = e->next_archive;
+         entry_free(cache, e);
+      }
+   }
+
+   pthread_cond_destroy(&cache->loaded);
+   pthread_mutex_destroy(&cache->mutex);
+   const struct xi_allocator allocator = cache->allocator;
+   xi_free(&allocator, cache->keys);
+   xi_free(&allocator, cache->archives);
+   xi_free(&allocator, cache->root);
+   xi_free(&allocator, cache);
+}
+
+struct xi_archive*
+xi_cache_get(struct xi_cache *cache, const char *path)
+{
+   assert(cache && path);
+
+   pthread_mutex_lock(&cache->mutex);
+
+   bool waited = false;
+   struct xi_cache_entry *entry;
+   while ((entry = cache_find_key(cache, path))) {
+      if (entry->loading) {
+         // someone else is loading the same file, wait for it
+         if (!waited)
+            cache->stats.coalesced += 1;
+
+         waited = true;
+         pthread_cond_wait(&cache->loaded, &cache->mutex);
+         continue;
+      }
+
+      cache->stats.hits += 1;
+      entry->refs += 1;
+      lru_remove(cache, entry);
+      lru_push_front(cache, entry);
+      pthread_mutex_unlock(&cache->mutex);
+      return entry->archive;
+   }
+
+   cache->stats.misses += 1;
+
+   if (!cache_grow(cache) || !(entry = xi_calloc(&cache->allocator, 1, sizeof(struct xi_cache_entry))))
+      goto fail;
+
+   if (!(entry->key = string_dup(&cache->allocator, path))) {
+      xi_free(&cache->allocator, entry);
+      goto fail;
+   }
+
+   entry->loading = true;
+   struct xi_cache_entry **bucket = &cache->keys[hash_key(path) & (cache->buckets - 1)];
+   entry->next_key = *bucket;
+   *bucket = entry;
+   cache->entries += 1;
+   pthread_mutex_unlock(&cache->mutex);
+
+   struct xi_archive *archive = xi_archive_load_from_file_with_options(path, &cache->options);
+   const size_t size = (archive ? xi_archive_get_memory_usage(archive) : 0);
+
+   pthread_mutex_lock(&cache->mutex);
+   entry->loading = false;
+
+   if (!archive) {
+      cache_unlink_key(cache, entry);
+      cache->entries -= 1;
+      entry_free(cache, entry);
+      pthread_cond_broadcast(&cache->loaded);
+      goto fail;
+   }
+
+   entry->archive = archive;
+   entry->size = size;
+   entry->refs = 1;
+   cache_link_archive(cache, entry);
+   cache->stats.bytes += size;
+   cache->stats.entries += 1;
+
+   if (entry->stale) {
+      // invalidated while loading, may hold the old contents so next get loads again
+      cache_unlink_key(cache, entry);
+   } else {
+      lru_push_front(cache, entry);
+   }
+
+   cache_evict(cache);
+   pthread_cond_broadcast(&cache->loaded);
+   pthread_mutex_unlock(&cache->mutex);
+   return archive;
+
+fail:
+   pthread_mutex_unlock(&cache->mutex);
+   return NULL;
+}
+
+struct xi_archive*
+xi_cache_get_by_id(struct xi_cache *cache, const uint16_t id)
+{
+   assert(cache);
+
+   char file[20];
+   xi_id_to_path(id, file);
+
+   char path[4096];
+   if (snprintf(path, sizeof(path), "%s/%s", (cache->root ? cache->root : "."), file) >= (int)sizeof(path))
+      return NULL;
+
+   return xi_cache_get(cache, path);
+}
+
+void
+xi_cache_release(struct xi_cache *cache, struct xi_archive *archive)
+{
+   assert(cache && archive);
+
+   pthread_mutex_lock(&cache->mutex);
+
+   struct xi_cache_entry *entry;
+   if (!(entry = cache_find_archive(cache, archive))) {
+      assert(0 && "archive is not from this cache");
+      pthread_mutex_unlock(&cache->mutex);
+      return;
+   }
+
+   assert(entry->refs > 0);
+   entry->refs -= 1;
+
+   if (!entry->refs && entry->stale) {
+      cache_drop(cache, entry);
+   } else if (!entry->refs) {
+      cache_evict(cache);
+   }
+
+   pthread_mutex_unlock(&cache->mutex);
+}
+
+void
+xi_cache_invalidate(struct xi_cache *cache, const char *path)
+{
+   assert(cache && path);
+
+   pthread_mutex_lock(&cache->mutex);
+
+   struct xi_cache_entry *entry;
+   if ((entry = cache_find_key(cache, path))) {
+      if (entry->loading) {
+         // load may have read the old contents, xi_cache_get unlinks it once done
+         entry->stale = true;
+      } else if (!entry->refs) {
+         cache_drop(cache, entry);
+      } else {
+         // next get loads again, archive is freed once the last reference is released
+         cache_unlink_key(cache, entry);
+         lru_remove(cache, entry);
+         entry->stale = true;
+      }
+   }
+
+   pthread_mutex_unlock(&cache->mutex);
+}
+
+void
+xi_cache_get_stats(struct xi_cache *cache, struct xi_cache_stats *out_stats)
+{
+   assert(cache && out_stats);
+
+   pthread_mutex_lock(&cache->mutex);
+   *out_stats = cache->stats;
+   pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "xi.h"
+#include "allocator.h"
+
+#define XI_NAME_INDEX_VERSION 1
+
+// entries per front-coded block, first entry of a block is stored in full
+#define XI_NAME_BLOCK 16
+
+/**
+ * Image layout, offsets are relative to the start of the image.
+ * refs: struct xi_name_ref[count], in name order
+ * blocks: uint32_t[num_blocks], offset of each block in the image
+ * block entry: uint8_t shared, uint8_t suffix_length, suffix bytes
+ */
+struct xi_name_index_header {
+   char magic[4]; // "XINI"
+   uint32_t version;
+   uint32_t count;
+   uint32_t num_blocks;
+   uint32_t refs;
+   uint32_t blocks;
+   uint32_t names;
+   uint32_t size;
+};
+
+struct xi_name_ref {
+   uint32_t archive, record;
+};
+
+struct xi_name_index {
+   struct xi_allocator allocator;
+   const uint8_t *data;
+   size_t size;
+   bool owned;
+};
+
+struct name {
+   const char *data;
+   size_t length;
+   struct xi_name_ref ref;
+};
+
+struct names {
+   const struct xi_allocator *allocator;
+   struct name *names;
+   size_t count, allocated;
+};
+
+static inline uint8_t
+fold(const uint8_t c)
+{
+   // ASCII only, Shift-JIS and UTF-8 bytes compare as they are
+   return (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+static int
+fold_compare(const char *a, const size_t a_length, const char *b, const size_t b_length)
+{
+   const size_t length = (a_length < b_length ? a_length : b_length);
+   for (size_t i = 0; i < length; ++i) {
+      const uint8_t x = fold(a[i]), y = fold(b[i]);
+      if (x != y)
+         return (x < y ? -1 : 1);
+   }
+
+   return (a_length > b_length) - (a_length < b_length);
+}
+
+static bool
+fold_has_prefix(const char *name, const size_t length, const char *prefix, const size_t prefix_length)
+{
+   return (length >= prefix_length && !fold_compare(name, prefix_length, prefix, prefix_length));
+}
+
+static int
+name_compare(const void *a, const void *b)
+{
+   const struct name *x = a, *y = b;
+
+   int ret;
+   if ((ret = fold_compare(x->data, x->length, y->data, y->length)))
+      return ret;
+
+   // identical names keep the order of archives and records
+   if (x->ref.archive != y->ref.archive)
+      return (x->ref.archive < y->ref.archive ? -1 : 1);
+
+   return (x->ref.record > y->ref.record) - (x->ref.record < y->ref.record);
+}
+
+static bool
+names_add(struct names *names, const char *data, size_t length, const uint32_t archive, const uint32_t record)
+{
+   assert(names);
+
+   if (!data)
+      return true;
+
+   const char *end;
+   if ((end = memchr(data, 0, length)))
+      length = end - data;
+
+   length = (length > XI_NAME_MAX ? XI_NAME_MAX : length);
+   if (!length)
+      return true;
+
+   if (names->count >= names->allocated) {
+      void *tmp;
+      const size_t allocated = (names->allocated ? names->allocated * 2 : 1024);
+      if (allocated > SIZE_MAX / sizeof(struct name) || !(tmp = xi_realloc(names->allocator, names->names, allocated * sizeof(struct name))))
+         return false;
+
+      names->names = tmp;
+      names->allocated = allocated;
+   }
+
+   names->names[names->count++] = (struct name){ .data = data, .length = length, .ref = { archive, record } };
+   return true;
+}
+
+static bool
+names_add_archive(struct names *names, struct xi_archive *archive, const uint32_t index)
+{
+   assert(names && archive);
+
+   size_t count;
+   const struct xi_data *data = xi_archive_get_data_list(archive, &count);
+   for (size_t i = 0; i < count; ++i) {
+      bool ret = true;
+      switch (data[i].type) {
+         case XI_TYPE_NAME_ID:
+            ret = names_add(names, data[i].name_id->name, sizeof(data[i].name_id->name), index, i);
+            break;
+
+         case XI_TYPE_ABILITY:
+            ret = names_add(names, data[i].ability->name, sizeof(data[i].ability->name), index, i);
+            break;
+
+         case XI_TYPE_SPELL:
+            ret = names_add(names, data[i].spell->en_name, sizeof(data[i].spell->en_name), index, i);
+            break;
+
+         case XI_TYPE_ITEM:
+            if (data[i].item->num_strings > 0)
+               ret = names_add(names, data[i].item->strings[0].data, data[i].item->strings[0].length, index, i);
+            break;
+
+         default:
+            break;
+      }
+
+      if (!ret)
+         return false;
+   }
+
+   // compact records refer to the archive's string pool
+   const char *name;
+   size_t length;
+
+   const struct xi_ability_compact *abilities = xi_archive_get_compact_ability_list(archive, &count);
+   for (size_t i = 0; abilities && i < count; ++i) {
+      if ((name = xi_archive_get_string(archive, abilities[i].name, &length)) && !names_add(names, name, length, index, i))
+         return false;
+   }
+
+   const struct xi_spell_compact *spells = xi_archive_get_compact_spell_list(archive, &count);
+   for (size_t i = 0; spells && i < count; ++i) {
+      if ((name = xi_archive_get_string(archive, spells[i].name, &length)) && !names_add(names, name, length, index, i))
+         return false;
+   }
+
+   return true;
+}
+
+static size_t
+shared_prefix(const char *a, const size_t a_length, const char *b, const size_t b_length)
+{
+   size_t i = 0;
+   const size_t length = (a_length < b_length ? a_length : b_length);
+   for (; i < length && a[i] == b[i]; ++i);
+   return i;
+}
+
+static uint8_t*
+image_build(const struct names *names, const struct xi_allocator *allocator, size_t *out_size)
+{
+   assert(names && allocator && out_size);
+
+   const size_t num_blocks = (names->count + XI_NAME_BLOCK - 1) / XI_NAME_BLOCK;
+   const size_t refs = sizeof(struct xi_name_index_header);
+   const size_t blocks = refs + names->count * sizeof(struct xi_name_ref);
+   const size_t offset = blocks + num_blocks * sizeof(uint32_t);
+
+   // front-coded size can only be smaller than every name stored in full
+   size_t size = offset;
+   for (size_t i = 0; i < names->count; ++i)
+      size += 2 + names->names[i].length;
+
+   if (size > UINT32_MAX)
+      return NULL;
+
+   uint8_t *image;
+   if (!(image = xi_calloc(allocator, 1, size)))
+      return NULL;
+
+   uint8_t *p = image + offset;
+   for (size_t i = 0; i < names->count; ++i) {
+      const struct name *name = &names->names[i];
+      memcpy(image + refs + i * sizeof(struct xi_name_ref), &name->ref, sizeof(struct xi_name_ref));
+
+      size_t shared = 0;
+      if (i % XI_NAME_BLOCK == 0) {
+         const uint32_t block = p - image;
+         memcpy(image + blocks + (i / XI_NAME_BLOCK) * sizeof(uint32_t), &block, sizeof(block));
+      } else {
+         shared = shared_prefix(names->names[i - 1].data, names->names[i - 1].length, name->data, name->length);
+      }
+
+      *p++ = shared;
+      *p++ = name->length - shared;
+      memcpy(p, name->data + shared, name->length - shared);
+      p += name->length - shared;
+   }
+
+   const struct xi_name_index_header header = {
+      .magic = { 'X', 'I', 'N', 'I' },
+      .version = XI_NAME_INDEX_VERSION,
+      .count = names->count,
+      .num_blocks = num_blocks,
+      .refs = refs,
+      .blocks = blocks,
+      .names = offset,
+      .size = p - image,
+   };
+
+   memcpy(image, &header, sizeof(header));
+   *out_size = header.size;
+   return image;
+}
+
+static bool
+index_validate(const struct xi_name_index *index)
+{
+   assert(index);
+
+   const struct xi_name_index_header *header = (const struct xi_name_index_header*)index->data;
+   if (index->size < sizeof(*header) || memcmp(header->magic, "XINI", sizeof(header->magic)) || header->version != XI_NAME_INDEX_VERSION)
+      return false;
+
+   if (header->size > index->size ||
+       header->num_blocks != (header->count + XI_NAME_BLOCK - 1) / XI_NAME_BLOCK ||
+       header->refs < sizeof(*header) || (uint64_t)header->refs + (uint64_t)header->count * sizeof(struct xi_name_ref) > header->blocks ||
+       (uint64_t)header->blocks + (uint64_t)header->num_blocks * sizeof(uint32_t) > header->names ||
+       header->names > header->size)
+      return false;
+
+   for (uint32_t b = 0; b < header->num_blocks; ++b) {
+      uint32_t block;
+      memcpy(&block, index->data + header->blocks + b * sizeof(uint32_t), sizeof(block));
+      if (block < header->names || block >= header->size)
+         return false;
+   }
+
+   return true;
+}
+
+struct xi_name_index*
+xi_name_index_new(struct xi_archive **archives, const size_t count)
+{
+   return xi_name_index_new_with_allocator(archives, count, NULL);
+}
+
+struct xi_name_index*
+xi_name_index_new_with_allocator(struct xi_archive **archives, const size_t count, const struct xi_allocator *allocator)
+{
+   assert(archives || !count);
+
+   if (!allocator)
+      allocator = &xi_default_allocator;
+
+   struct names names = { .allocator = allocator };
+   struct xi_name_index *index = NULL;
+
+   for (size_t i = 0; i < count; ++i) {
+      if (!names_add_archive(&names, archives[i], i))
+         goto fail;
+   }
+
+   qsort(names.names, names.count, sizeof(struct name), name_compare);
+
+   if (!(index = xi_calloc(allocator, 1, sizeof(struct xi_name_index))))
+      goto fail;
+
+   index->allocator = *allocator;
+
+   uint8_t *image;
+   if (!(image = image_build(&names, allocator, &index->size)))
+      goto fail;
+
+   index->data = image;
+   index->owned = true;
+   xi_free(allocator, names.names);
+   return index;
+
+fail:
+   xi_free(allocator, names.names);
+   xi_free(allocator, index);
+   return NULL;
+}
+
+struct xi_name_index*
+xi_name_index_attach_memory(const void *data, const size_t size)
+{
+   return xi_name_index_attach_memory_with_allocator(data, size, NULL);
+}
+
+struct xi_name_index*
+xi_name_index_attach_memory_with_allocator(const void *data, const size_t size, const struct xi_allocator *allocator)
+{
+   assert(data);
+
+   if (!allocator)
+      allocator = &xi_default_allocator;
+
+   struct xi_name_index *index;
+   if (!(index = xi_calloc(allocator, 1, sizeof(struct xi_name_index))))
+      return NULL;
+
+   index->allocator = *allocator;
+   index->data = data;
+   index->size = size;
+
+   if (!index_validate(index)) {
+      xi_free(allocator, index);
+      return NULL;
+   }
+
+   return index;
+}
+
+void
+xi_name_index_free(struct xi_name_index *index)
+{
+   assert(index);
+
+   const struct xi_allocator allocator = index->allocator;
+
+   if (index->owned)
+      xi_free(&allocator, (void*)index->data);
+
+   xi_free(&allocator, index);
+}
+
+const void*
+xi_name_index_get_image(const struct xi_name_index *index, size_t *out_size)
+{
+   assert(index && out_size);
+   *out_size = index->size;
+   return index->data;
+}
+
+/**
+ * Cursor over front-coded names, decoded into name.
+ */
+struct cursor {
+   const uint8_t *p, *end;
+   char name[XI_NAME_MAX];
+   size_t length;
+};
+
+static bool
+cursor_next(struct cursor *cursor)
+{
+   assert(cursor);
+
+   if (cursor->p + 2 > cursor->end)
+      return false;
+
+   const size_t shared = cursor->p[0], suffix = cursor->p[1];
+   if (shared > cursor->length || shared + suffix > XI_NAME_MAX || cursor->p + 2 + suffix > cursor->end)
+      return false;
+
+   memcpy(cursor->name + shared, cursor->p + 2, suffix);
+   cursor->length = shared + suffix;
+   cursor->p += 2 + suffix;
+   return true;
+}
+
+static bool
+cursor_seek_block(struct cursor *cursor, const struct xi_name_index *index, const uint32_t block)
+{
+   assert(cursor && index);
+
+   const struct xi_name_index_header *header = (const struct xi_name_index_header*)index->data;
+
+   uint32_t offset;
+   memcpy(&offset, index->data + header->blocks + block * sizeof(uint32_t), sizeof(offset));
+   cursor->p = index->data + offset;
+   cursor->end = index->data + header->size;
+   cursor->length = 0;
+   return cursor_next(cursor);
+}
+
+size_t
+xi_name_index_find(const struct xi_name_index *index, const char *prefix, struct xi_name_match *out_matches, const size_t max)
+{
+   assert(index && prefix && (out_matches || !max));
+
+   const struct xi_name_index_header *header = (const struct xi_name_index_header*)index->data;
+   const size_t length = strlen(prefix);
+   if (!header->count || !max)
+      return 0;
+
+   // first block whose head is not before the prefix, matches may start in the block before it
+   struct cursor cursor;
+   uint32_t lo = 0, hi = header->num_blocks;
+   while (lo < hi) {
+      const uint32_t mid = lo + (hi - lo) / 2;
+      if (!cursor_seek_block(&cursor, index, mid))
+         return 0;
+
+      if (fold_compare(cursor.name, cursor.length, prefix, length) < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+
+   const uint32_t block = (lo > 0 ? lo - 1 : 0);
+   if (!cursor_seek_block(&cursor, index, block))
+      return 0;
+
+   size_t count = 0;
+   for (size_t i = block * XI_NAME_BLOCK; i < header->count; ++i) {
+      if (i > block * XI_NAME_BLOCK && !cursor_next(&cursor))
+         break;
+
+      if (fold_has_prefix(cursor.name, cursor.length, prefix, length)) {
+         struct xi_name_match *match = &out_matches[count];
+         memcpy(&match->archive, index->data + header->refs + i * sizeof(struct xi_name_ref), sizeof(uint32_t));
+         memcpy(&match->record, index->data + header->refs + i * sizeof(struct xi_name_ref) + sizeof(uint32_t), sizeof(uint32_t));
+         memcpy(match->name, cursor.name, cursor.length);
+         match->name[cursor.length] = 0;
+
+         if (++count >= max)
+            break;
+      } else if (fold_compare(cursor.name, cursor.length, prefix, length) > 0) {
+         break;
+      }
+   }
+
+   return count;
+}
@@ -0,0 +1,97 @@
+#ifndef __LIBXI_SCHEMA_H__
+#define __LIBXI_SCHEMA_H__
+
+/**
+ * Record layouts of .dat files.
+ * Each row is X(kind, field, offset), kind is U8, U16, U32, U8_ARRAY (fixed width array of numbers)
+ * or BYTES (fixed width text), arrays span sizeof the field.
+ * Readers and sizes are generated from these with XI_DEFINE_RECORD in xi.c.
+ */
+
+#define XI_SCHEMA_NAME_ID(X) \
+   X(BYTES, name, 0x00) \
+   X(U32, id, 0x1C)
+
+#define XI_SCHEMA_ABILITY(X) \
+   X(U16, index, 0x00) \
+   X(U16, icon_id, 0x02) \
+   X(U16, mp_cost, 0x04) \
+   X(U16, unknown, 0x06) \
+   X(U16, targets, 0x08) \
+   X(BYTES, name, 0x0A) \
+   X(BYTES, description, 0x2A)
+
+#define XI_SCHEMA_SPELL(X) \
+   X(U16, index, 0x00) \
+   X(U16, type, 0x02) \
+   X(U16, element, 0x04) \
+   X(U16, targets, 0x06) \
+   X(U16, skill, 0x08) \
+   X(U16, mp_cost, 0x0A) \
+   X(U8, casting_time, 0x0C) \
+   X(U8, recast_delay, 0x0D) \
+   X(U8_ARRAY, level, 0x0E) \
+   X(U16, id, 0x26) \
+   X(U8, unknown, 0x28) \
+   X(BYTES, jp_name, 0x29) \
+   X(BYTES, en_name, 0x3D) \
+   X(BYTES, jp_description, 0x51) \
+   X(BYTES, en_description, 0xD1)
+
+#define XI_SCHEMA_ITEM(X) \
+   X(U32, id, 0x00) \
+   X(U16, flags, 0x04) \
+   X(U16, stack, 0x06) \
+   X(U16, type, 0x08) \
+   X(U16, resource, 0x0A) \
+   X(U16, targets, 0x0C)
+
+/**
+ * Item payloads follow the item header.
+ */
+
+#define XI_SCHEMA_ITEM_WEAPON(X) \
+   X(U16, level, 0x00) \
+   X(U16, slots, 0x02) \
+   X(U16, races, 0x04) \
+   X(U32, jobs, 0x06) \
+   X(U16, damage, 0x0A) \
+   X(U16, delay, 0x0C) \
+   X(U16, dps, 0x0E) \
+   X(U8, skill, 0x10) \
+   X(U8, jug_size, 0x11) \
+   X(U32, unknown, 0x12) \
+   X(U8, max_charges, 0x16) \
+   X(U8, casting_time, 0x17) \
+   X(U16, use_delay, 0x18) \
+   X(U32, reuse_delay, 0x1A) \
+   X(U32, unknown2, 0x1E)
+
+#define XI_SCHEMA_ITEM_ARMOR(X) \
+   X(U16, level, 0x00) \
+   X(U16, slots, 0x02) \
+   X(U16, races, 0x04) \
+   X(U32, jobs, 0x06) \
+   X(U16, shield_size, 0x0A) \
+   X(U8, max_charges, 0x0C) \
+   X(U8, casting_time, 0x0D) \
+   X(U16, use_delay, 0x0E) \
+   X(U16, unknown, 0x10) \
+   X(U32, reuse_delay, 0x12) \
+   X(U32, unknown2, 0x16)
+
+#define XI_SCHEMA_ITEM_PUPPET(X) \
+   X(U16, slot, 0x00) \
+   X(U32, element_charge, 0x02) \
+   X(U32, unknown, 0x06)
+
+#define XI_SCHEMA_ITEM_GENERAL(X) \
+   X(U16, element, 0x00) \
+   X(U32, storage_slots, 0x02)
+
+#define XI_SCHEMA_ITEM_USABLE(X) \
+   X(U16, activation_time, 0x00) \
+   X(U32, unknown, 0x02) \
+   X(U32, unknown2, 0x06)
+
+#endif /* __LIBXI_SCHEMA_H__ */
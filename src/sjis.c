@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "xi.h"
+#include "sjis-table.h"
+
+// elements as shown by the JP client: fire, ice, wind, earth, lightning, water, light, dark
+static const uint16_t xi_element_symbols[8] = {
+   0x706B, 0x6C37, 0x98A8, 0x571F, 0x96F7, 0x6C34, 0x5149, 0x95C7,
+};
+
+struct writer {
+   char *out;
+   size_t size, written, length;
+   bool truncated;
+};
+
+static void
+writer_put(struct writer *w, const char *bytes, const size_t size)
+{
+   assert(w && bytes);
+
+   // never write partial characters, and leave room for \0
+   if (!w->truncated && w->written + size < w->size) {
+      memcpy(w->out + w->written, bytes, size);
+      w->written += size;
+   } else {
+      w->truncated = true;
+   }
+
+   w->length += size;
+}
+
+static void
+writer_put_codepoint(struct writer *w, const uint16_t cp)
+{
+   assert(w);
+
+   char bytes[3];
+   if (cp < 0x80) {
+      bytes[0] = cp;
+      writer_put(w, bytes, 1);
+   } else if (cp < 0x800) {
+      bytes[0] = 0xC0 | (cp >> 6);
+      bytes[1] = 0x80 | (cp & 0x3F);
+      writer_put(w, bytes, 2);
+   } else {
+      bytes[0] = 0xE0 | (cp >> 12);
+      bytes[1] = 0x80 | ((cp >> 6) & 0x3F);
+      bytes[2] = 0x80 | (cp & 0x3F);
+      writer_put(w, bytes, 3);
+   }
+}
+
+static bool
+is_ascii16(const uint8_t *data)
+{
+   uint64_t a, b;
+   memcpy(&a, data, sizeof(a));
+   memcpy(&b, data + sizeof(a), sizeof(b));
+   return !((a | b) & UINT64_C(0x8080808080808080));
+}
+
+static bool
+is_lead_byte(const uint8_t c)
+{
+   return ((c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC));
+}
+
+static uint16_t
+lookup_double(const uint8_t lead, const uint8_t trail)
+{
+   assert(is_lead_byte(lead));
+
+   if (trail < 0x40 || trail > 0xFC || trail == 0x7F)
+      return 0;
+
+   return xi_sjis_table[(lead <= 0x9F ? lead - 0x81 : lead - 0xE0 + 31)][trail - 0x40];
+}
+
+size_t
+xi_sjis_to_utf8(const char *data, const size_t length, char *out, const size_t out_size, const char* (*autotranslate)(const uint32_t id, void *userdata), void *userdata)
+{
+   assert(data || !length);
+   assert(out || !out_size);
+
+   struct writer w = { .out = out, .size = out_size };
+   const uint8_t *in = (const uint8_t*)data;
+
+   for (size_t i = 0; i < length;) {
+      if (i + 16 <= length && is_ascii16(in + i)) {
+         writer_put(&w, (const char*)in + i, 16);
+         i += 16;
+         continue;
+      }
+
+      const uint8_t c = in[i];
+      if (c < 0x80) {
+         writer_put(&w, (const char*)in + i, 1);
+         i += 1;
+      } else if (c == 0xFD && i + 6 <= length && in[i + 5] == 0xFD) {
+         // auto-translate: 0xFD type language group id 0xFD
+         const uint32_t id = (in[i + 1] << 24) | (in[i + 2] << 16) | (in[i + 3] << 8) | in[i + 4];
+         const char *phrase = (autotranslate ? autotranslate(id, userdata) : NULL);
+
+         writer_put(&w, "{", 1);
+         if (phrase) {
+            writer_put(&w, phrase, strlen(phrase));
+         } else {
+            char hex[10];
+            snprintf(hex, sizeof(hex), "#%08X", id);
+            writer_put(&w, hex, 9);
+         }
+         writer_put(&w, "}", 1);
+         i += 6;
+      } else if (c == 0xEF && i + 1 < length && in[i + 1] >= 0x1F && in[i + 1] <= 0x28) {
+         // special characters: element symbols and auto-translate brackets
+         if (in[i + 1] == 0x27) {
+            writer_put(&w, "{", 1);
+         } else if (in[i + 1] == 0x28) {
+            writer_put(&w, "}", 1);
+         } else {
+            writer_put_codepoint(&w, xi_element_symbols[in[i + 1] - 0x1F]);
+         }
+         i += 2;
+      } else if (c >= 0xA1 && c <= 0xDF) {
+         // half-width katakana
+         writer_put_codepoint(&w, 0xFF61 + (c - 0xA1));
+         i += 1;
+      } else if (is_lead_byte(c) && i + 1 < length) {
+         const uint16_t cp = lookup_double(c, in[i + 1]);
+         writer_put_codepoint(&w, (cp ? cp : 0xFFFD));
+         i += 2;
+      } else {
+         writer_put_codepoint(&w, 0xFFFD);
+         i += 1;
+      }
+   }
+
+   if (out_size > 0)
+      out[w.written] = 0;
+
+   return w.length;
+}
@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xi.h"
+#include "allocator.h"
+
+#define XI_STORE_VERSION 1
+
+struct xi_store {
+   struct xi_allocator allocator;
+   const uint8_t *data;
+   size_t size;
+   bool mapped;
+};
+
+struct image {
+   const struct xi_allocator *allocator;
+   uint8_t *data;
+   size_t size, allocated;
+};
+
+static size_t
+align(const size_t size)
+{
+   return (size + 7) & ~(size_t)7;
+}
+
+static bool
+image_reserve(struct image *image, const size_t size, size_t *out_offset)
+{
+   assert(image && out_offset);
+
+   const size_t offset = align(image->size);
+   if (offset + size > UINT32_MAX)
+      return false;
+
+   if (offset + size > image->allocated) {
+      size_t allocated = (image->allocated > 0 ? image->allocated : 4096);
+      while (allocated < offset + size)
+         allocated *= 2;
+
+      void *tmp;
+      if (!(tmp = xi_realloc(image->allocator, image->data, allocated)))
+         return false;
+
+      image->data = tmp;
+      image->allocated = allocated;
+   }
+
+   memset(image->data + image->size, 0, offset + size - image->size);
+   image->size = offset + size;
+   *out_offset = offset;
+   return true;
+}
+
+static bool
+image_add(struct image *image, const void *data, const size_t size, size_t *out_offset)
+{
+   assert(image && data && out_offset);
+
+   if (!image_reserve(image, size, out_offset))
+      return false;
+
+   memcpy(image->data + *out_offset, data, size);
+   return true;
+}
+
+static bool
+image_add_string(struct image *image, const size_t base, const char *data, const size_t length, uint32_t *out_ref)
+{
+   assert(image && out_ref);
+
+   if (!data) {
+      *out_ref = XI_STORE_NO_STRING;
+      return true;
+   }
+
+   // same format as archive string pool, uint16_t length + bytes + \0
+   if (length > 0xFFFF || image->size + sizeof(uint16_t) + length + 1 > UINT32_MAX)
+      return false;
+
+   const size_t offset = image->size;
+   if (offset + sizeof(uint16_t) + length + 1 > image->allocated) {
+      size_t allocated = image->allocated;
+      while (allocated < offset + sizeof(uint16_t) + length + 1)
+         allocated *= 2;
+
+      void *tmp;
+      if (!(tmp = xi_realloc(image->allocator, image->data, allocated)))
+         return false;
+
+      image->data = tmp;
+      image->allocated = allocated;
+   }
+
+   uint8_t *entry = image->data + offset;
+   entry[0] = length & 0xFF;
+   entry[1] = (length >> 8) & 0xFF;
+   memcpy(entry + sizeof(uint16_t), data, length);
+   entry[sizeof(uint16_t) + length] = 0;
+   image->size += sizeof(uint16_t) + length + 1;
+   *out_ref = offset - base;
+   return true;
+}
+
+static bool
+serialize_items(struct image *image, const struct xi_data *data, const size_t count)
+{
+   assert(image && (data || !count));
+
+   struct xi_store_header *header = (struct xi_store_header*)image->data;
+   header->record_size = sizeof(struct xi_store_item);
+
+   size_t records;
+   if (!image_reserve(image, count * sizeof(struct xi_store_item), &records))
+      return false;
+
+   // payloads and string tables are appended after the records
+   for (size_t i = 0; i < count; ++i) {
+      const struct xi_item *item = data[i].item;
+      struct xi_store_item flat = {
+         .id = item->id,
+         .flags = item->flags,
+         .stack = item->stack,
+         .type = item->type,
+         .resource = item->resource,
+         .targets = item->targets,
+         .num_strings = item->num_strings,
+      };
+
+      size_t offset;
+      const size_t payload_size = (item->any ? xi_item_payload_size(item->type, item->flags) : 0);
+      if (payload_size > 0) {
+         if (!image_add(image, item->any, payload_size, &offset))
+            return false;
+         flat.payload = offset;
+      }
+
+      if (item->num_strings > 0) {
+         if (!image_reserve(image, item->num_strings * sizeof(struct xi_store_string), &offset))
+            return false;
+         flat.strings = offset;
+      }
+
+      memcpy(image->data + records + i * sizeof(flat), &flat, sizeof(flat));
+   }
+
+   // string pool starts aligned like every other section
+   size_t pool;
+   if (!image_reserve(image, 0, &pool))
+      return false;
+
+   header = (struct xi_store_header*)image->data;
+   header->records = records;
+   header->count = count;
+   header->strings = pool;
+
+   const size_t base = header->strings;
+   for (size_t i = 0; i < count; ++i) {
+      const struct xi_item *item = data[i].item;
+      const struct xi_store_item *flat = (struct xi_store_item*)(image->data + records + i * sizeof(struct xi_store_item));
+      const size_t strings = flat->strings;
+
+      for (uint32_t s = 0; s < item->num_strings; ++s) {
+         struct xi_store_string string = { .flags = item->strings[s].flags };
+         if (!image_add_string(image, base, item->strings[s].data, item->strings[s].length, &string.ref))
+            return false;
+
+         memcpy(image->data + strings + s * sizeof(string), &string, sizeof(string));
+      }
+   }
+
+   return true;
+}
+
+static bool
+serialize_fixed(struct image *image, const struct xi_data *data, const size_t count, const size_t record_size)
+{
+   assert(image && (data || !count) && record_size > 0);
+
+   size_t records;
+   if (!image_reserve(image, count * record_size, &records))
+      return false;
+
+   for (size_t i = 0; i < count; ++i)
+      memcpy(image->data + records + i * record_size, data[i].any, record_size);
+
+   size_t pool;
+   if (!image_reserve(image, 0, &pool))
+      return false;
+
+   struct xi_store_header *header = (struct xi_store_header*)image->data;
+   header->record_size = record_size;
+   header->records = records;
+   header->count = count;
+   header->strings = pool;
+   return true;
+}
+
+static bool
+serialize_compact(struct image *image, struct xi_archive *archive)
+{
+   assert(image && archive);
+
+   size_t count, record_size;
+   const void *list;
+   if (xi_archive_get_type(archive) == XI_TYPE_ABILITY) {
+      list = xi_archive_get_compact_ability_list(archive, &count);
+      record_size = sizeof(struct xi_ability_compact);
+   } else {
+      list = xi_archive_get_compact_spell_list(archive, &count);
+      record_size = sizeof(struct xi_spell_compact);
+   }
+
+   size_t records, pool;
+   if (!image_reserve(image, count * record_size, &records) || !image_reserve(image, 0, &pool))
+      return false;
+
+   struct xi_store_header *header = (struct xi_store_header*)image->data;
+   header->flags |= XI_STORE_COMPACT;
+   header->record_size = record_size;
+   header->records = records;
+   header->count = count;
+   header->strings = pool;
+
+   // compact records start with name and description references
+   const size_t base = header->strings;
+   for (size_t i = 0; i < count; ++i) {
+      uint32_t refs[2];
+      memcpy(refs, (const uint8_t*)list + i * record_size, sizeof(refs));
+
+      for (int r = 0; r < 2; ++r) {
+         size_t length;
+         const char *string = xi_archive_get_string(archive, refs[r], &length);
+         if (!image_add_string(image, base, string, length, &refs[r]))
+            return false;
+      }
+
+      uint8_t *record = image->data + records + i * record_size;
+      memcpy(record, (const uint8_t*)list + i * record_size, record_size);
+      memcpy(record, refs, sizeof(refs));
+   }
+
+   return true;
+}
+
+void*
+xi_archive_serialize(struct xi_archive *archive, size_t *out_size)
+{
+   assert(archive && out_size);
+
+   *out_size = 0;
+
+   size_t offset;
+   struct image image = { .allocator = xi_archive_get_allocator(archive) };
+   if (!image_reserve(&image, sizeof(struct xi_store_header), &offset))
+      goto fail;
+
+   const enum xi_data_type type = xi_archive_get_type(archive);
+   struct xi_store_header *header = (struct xi_store_header*)image.data;
+   header->version = XI_STORE_VERSION;
+   header->type = type;
+
+   size_t count;
+   const struct xi_data *data = xi_archive_get_data_list(archive, &count);
+
+   // compact archives have no abilities or spells in the data list
+   bool ret;
+   if (type == XI_TYPE_ITEM) {
+      ret = serialize_items(&image, data, count);
+   } else if (type == XI_TYPE_NAME_ID) {
+      ret = serialize_fixed(&image, data, count, sizeof(struct xi_name_id));
+   } else if ((type == XI_TYPE_ABILITY || type == XI_TYPE_SPELL) && count == 0) {
+      ret = serialize_compact(&image, archive);
+   } else if (type == XI_TYPE_ABILITY) {
+      ret = serialize_fixed(&image, data, count, sizeof(struct xi_ability));
+   } else if (type == XI_TYPE_SPELL) {
+      ret = serialize_fixed(&image, data, count, sizeof(struct xi_spell));
+   } else {
+      ret = true;
+   }
+
+   if (!ret)
+      goto fail;
+
+   header = (struct xi_store_header*)image.data;
+   header->strings_size = image.size - (header->strings ? header->strings : image.size);
+   header->size = image.size;
+   memcpy(header->magic, "XIST", sizeof(header->magic));
+   *out_size = image.size;
+   return image.data;
+
+fail:
+   xi_free(image.allocator, image.data);
+   return NULL;
+}
+
+static bool
+write_image(const int fd, const void *image, const size_t size)
+{
+   assert(fd >= 0 && image);
+
+   if (ftruncate(fd, size) != 0)
+      return false;
+
+   uint8_t *map;
+   if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      return false;
+
+   // magic is written last, so attaching to half written store fails
+   const size_t magic = sizeof(((struct xi_store_header*)0)->magic);
+   memcpy(map + magic, (const uint8_t*)image + magic, size - magic);
+#if defined(__GNUC__)
+   __sync_synchronize();
+#endif
+   memcpy(map, image, magic);
+   munmap(map, size);
+   return true;
+}
+
+int
+xi_store_publish(struct xi_archive *archive, const char *name)
+{
+   assert(archive && name);
+
+   int fd = -1;
+   void *image;
+   size_t size;
+   if (!(image = xi_archive_serialize(archive, &size)))
+      goto fail;
+
+   // replace, processes already attached keep the old segment
+   shm_unlink(name);
+
+   if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+      goto fail;
+
+   if (!write_image(fd, image, size))
+      goto fail;
+
+   close(fd);
+   xi_free(xi_archive_get_allocator(archive), image);
+   return 1;
+
+fail:
+   if (fd >= 0) {
+      close(fd);
+      shm_unlink(name);
+   }
+   xi_free(xi_archive_get_allocator(archive), image);
+   return 0;
+}
+
+int
+xi_store_publish_fd(struct xi_archive *archive)
+{
+   assert(archive);
+
+#if defined(MFD_CLOEXEC) && defined(MFD_ALLOW_SEALING)
+   int fd = -1;
+   void *image;
+   size_t size;
+   if (!(image = xi_archive_serialize(archive, &size)))
+      goto fail;
+
+   if ((fd = memfd_create("xi-store", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+      goto fail;
+
+   if (!write_image(fd, image, size))
+      goto fail;
+
+   // receivers can trust the contents never change
+   fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+   xi_free(xi_archive_get_allocator(archive), image);
+   return fd;
+
+fail:
+   if (fd >= 0)
+      close(fd);
+   xi_free(xi_archive_get_allocator(archive), image);
+   return -1;
+#else
+   return -1;
+#endif
+}
+
+int
+xi_store_unlink(const char *name)
+{
+   assert(name);
+   return (shm_unlink(name) == 0);
+}
+
+static size_t
+record_size_for(const uint32_t type, const uint32_t flags)
+{
+   const bool compact = (flags & XI_STORE_COMPACT);
+   switch (type) {
+      case XI_TYPE_ITEM: return sizeof(struct xi_store_item);
+      case XI_TYPE_NAME_ID: return sizeof(struct xi_name_id);
+      case XI_TYPE_ABILITY: return (compact ? sizeof(struct xi_ability_compact) : sizeof(struct xi_ability));
+      case XI_TYPE_SPELL: return (compact ? sizeof(struct xi_spell_compact) : sizeof(struct xi_spell));
+      default:break;
+   }
+
+   return 0;
+}
+
+static bool
+range_valid(const struct xi_store *store, const uint64_t offset, const uint64_t size)
+{
+   assert(store);
+   return (offset <= store->size && size <= store->size - offset);
+}
+
+static bool
+store_validate(const struct xi_store *store)
+{
+   assert(store);
+
+   const struct xi_store_header *header = (const struct xi_store_header*)store->data;
+   if (store->size < sizeof(struct xi_store_header) || memcmp(header->magic, "XIST", sizeof(header->magic)))
+      return false;
+
+   if (header->version != XI_STORE_VERSION || header->size != store->size || header->type > XI_TYPE_UNKNOWN)
+      return false;
+
+   // records are read in place, so they must be exactly the structs the type implies
+   if (header->record_size != record_size_for(header->type, header->flags) || header->records % 8 || header->strings % 8)
+      return false;
+
+   const uint64_t records_size = (uint64_t)header->count * header->record_size;
+   if (header->records < sizeof(struct xi_store_header) && records_size > 0)
+      return false;
+
+   return (range_valid(store, header->records, records_size) &&
+           header->records + records_size <= header->strings &&
+           range_valid(store, header->strings, header->strings_size));
+}
+
+struct xi_store*
+xi_store_attach_memory(const void *data, const size_t size)
+{
+   return xi_store_attach_memory_with_allocator(data, size, NULL);
+}
+
+struct xi_store*
+xi_store_attach_memory_with_allocator(const void *data, const size_t size, const struct xi_allocator *allocator)
+{
+   assert(data);
+
+   if (!allocator)
+      allocator = &xi_default_allocator;
+
+   struct xi_store *store;
+   if (!(store = xi_calloc(allocator, 1, sizeof(struct xi_store))))
+      return NULL;
+
+   store->allocator = *allocator;
+   store->data = data;
+   store->size = size;
+
+   if (!store_validate(store)) {
+      xi_free(allocator, store);
+      return NULL;
+   }
+
+   return store;
+}
+
+struct xi_store*
+xi_store_attach_fd(const int fd)
+{
+   return xi_store_attach_fd_with_allocator(fd, NULL);
+}
+
+struct xi_store*
+xi_store_attach_fd_with_allocator(const int fd, const struct xi_allocator *allocator)
+{
+   assert(fd >= 0);
+
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct xi_store_header))
+      return NULL;
+
+   void *map;
+   if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      return NULL;
+
+   struct xi_store *store;
+   if (!(store = xi_store_attach_memory_with_allocator(map, st.st_size, allocator))) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+
+   store->mapped = true;
+   return store;
+}
+
+struct xi_store*
+xi_store_attach(const char *name)
+{
+   return xi_store_attach_with_allocator(name, NULL);
+}
+
+struct xi_store*
+xi_store_attach_with_allocator(const char *name, const struct xi_allocator *allocator)
+{
+   assert(name);
+
+   int fd;
+   if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+      return NULL;
+
+   struct xi_store *store = xi_store_attach_fd_with_allocator(fd, allocator);
+   close(fd);
+   return store;
+}
+
+void
+xi_store_detach(struct xi_store *store)
+{
+   assert(store);
+
+   if (store->mapped)
+      munmap((void*)store->data, store->size);
+
+   const struct xi_allocator allocator = store->allocator;
+   xi_free(&allocator, store);
+}
+
+const struct xi_store_header*
+xi_store_get_header(const struct xi_store *store)
+{
+   assert(store);
+   return (const struct xi_store_header*)store->data;
+}
+
+const void*
+xi_store_get_record_list(const struct xi_store *store, size_t *out_count)
+{
+   assert(store);
+
+   const struct xi_store_header *header = xi_store_get_header(store);
+   if (out_count)
+      *out_count = header->count;
+
+   return store->data + header->records;
+}
+
+const char*
+xi_store_get_string(const struct xi_store *store, const uint32_t ref, size_t *out_length)
+{
+   assert(store);
+
+   const struct xi_store_header *header = xi_store_get_header(store);
+   if (ref == XI_STORE_NO_STRING || (uint64_t)ref + sizeof(uint16_t) > header->strings_size)
+      return NULL;
+
+   const uint8_t *entry = store->data + header->strings + ref;
+   const size_t length = entry[0] | (entry[1] << 8);
+   if ((uint64_t)ref + sizeof(uint16_t) + length + 1 > header->strings_size)
+      return NULL;
+
+   if (out_length)
+      *out_length = length;
+
+   return (const char*)entry + sizeof(uint16_t);
+}
+
+const void*
+xi_store_get_item_payload(const struct xi_store *store, const struct xi_store_item *item)
+{
+   assert(store && item);
+
+   const size_t size = xi_item_payload_size(item->type, item->flags);
+   if (!item->payload || !size || item->payload % 8 || !range_valid(store, item->payload, size))
+      return NULL;
+
+   return store->data + item->payload;
+}
+
+const struct xi_store_string*
+xi_store_get_item_strings(const struct xi_store *store, const struct xi_store_item *item)
+{
+   assert(store && item);
+
+   if (!item->strings || item->strings % 8 || !range_valid(store, item->strings, (uint64_t)item->num_strings * sizeof(struct xi_store_string)))
+      return NULL;
+
+   return (const struct xi_store_string*)(store->data + item->strings);
+}
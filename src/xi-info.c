@@ -1,27 +1,892 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "xi.h"
+#include "schema.h"
 
-int
-main(int argc, char **argv)
+enum format {
+   FORMAT_TEXT,
+   FORMAT_NDJSON,
+   FORMAT_CSV,
+};
+
+struct buffer {
+   char *data;
+   size_t size, allocated;
+   bool failed;
+};
+
+struct export {
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+
+   char **paths;
+   size_t count, next, written;
+   const struct type_map *types;
+   enum format format;
+   int ret;
+};
+
+static bool
+buffer_reserve(struct buffer *buffer, const size_t size)
 {
-   if (argc < 2) {
-      fprintf(stderr, "Supply some dat file paths as argument.\n");
+   assert(buffer);
+
+   if (buffer->failed)
+      return false;
+
+   if (buffer->size + size <= buffer->allocated)
+      return true;
+
+   size_t allocated = (buffer->allocated ? buffer->allocated : 1 << 16);
+   while (allocated < buffer->size + size)
+      allocated *= 2;
+
+   void *tmp;
+   if (!(tmp = realloc(buffer->data, allocated))) {
+      buffer->failed = true;
+      return false;
+   }
+
+   buffer->data = tmp;
+   buffer->allocated = allocated;
+   return true;
+}
+
+static void
+buffer_put(struct buffer *buffer, const char *data, const size_t size)
+{
+   assert(buffer && (data || !size));
+
+   if (!buffer_reserve(buffer, size))
+      return;
+
+   memcpy(buffer->data + buffer->size, data, size);
+   buffer->size += size;
+}
+
+#define buffer_put_literal(buffer, literal) buffer_put(buffer, literal, sizeof(literal) - 1)
+
+static void
+buffer_put_uint(struct buffer *buffer, uint64_t value)
+{
+   assert(buffer);
+
+   char digits[20], *p = digits + sizeof(digits);
+   do {
+      *--p = '0' + (value % 10);
+      value /= 10;
+   } while (value);
+
+   buffer_put(buffer, p, digits + sizeof(digits) - p);
+}
+
+static void
+buffer_put_json_string(struct buffer *buffer, const char *data, const size_t length)
+{
+   assert(buffer && (data || !length));
+
+   // worst case every byte becomes \u00XX
+   if (!buffer_reserve(buffer, length * 6 + 2))
+      return;
+
+   static const char hex[] = "0123456789abcdef";
+   char *out = buffer->data + buffer->size;
+   *out++ = '"';
+
+   for (size_t i = 0; i < length; ++i) {
+      const uint8_t c = data[i];
+      if (c >= 0x20 && c != '"' && c != '\\') {
+         *out++ = c;
+      } else if (c == '"' || c == '\\') {
+         *out++ = '\\';
+         *out++ = c;
+      } else if (c == '\n') {
+         *out++ = '\\';
+         *out++ = 'n';
+      } else if (c == '\r') {
+         *out++ = '\\';
+         *out++ = 'r';
+      } else if (c == '\t') {
+         *out++ = '\\';
+         *out++ = 't';
+      } else {
+         memcpy(out, "\\u00", 4);
+         out[4] = hex[c >> 4];
+         out[5] = hex[c & 0xF];
+         out += 6;
+      }
+   }
+
+   *out++ = '"';
+   buffer->size = out - buffer->data;
+}
+
+static void
+buffer_put_csv_escaped(struct buffer *buffer, const char *data, const size_t length)
+{
+   assert(buffer && (data || !length));
+
+   // worst case every byte is a doubled quote
+   if (!buffer_reserve(buffer, length * 2))
+      return;
+
+   char *out = buffer->data + buffer->size;
+   for (size_t i = 0; i < length; ++i) {
+      if (data[i] == '"')
+         *out++ = '"';
+      *out++ = data[i];
+   }
+
+   buffer->size = out - buffer->data;
+}
+
+static void
+buffer_put_csv_string(struct buffer *buffer, const char *data, const size_t length)
+{
+   buffer_put_literal(buffer, "\"");
+   buffer_put_csv_escaped(buffer, data, length);
+   buffer_put_literal(buffer, "\"");
+}
+
+static void
+buffer_put_string(struct buffer *buffer, const enum format format, const char *data, const size_t length)
+{
+   if (format == FORMAT_NDJSON) {
+      buffer_put_json_string(buffer, data, length);
+   } else {
+      buffer_put_csv_string(buffer, data, length);
+   }
+}
+
+static void
+buffer_put_text(struct buffer *buffer, const enum format format, const char *data, const size_t size)
+{
+   assert(data);
+
+   // fixed size text fields of abilities and spells are Shift-JIS, \0 terminated unless full
+   const char *end = memchr(data, 0, size);
+   const size_t length = (end ? (size_t)(end - data) : size);
+
+   char utf8[1024];
+   const size_t utf8_length = xi_sjis_to_utf8(data, length, utf8, sizeof(utf8), NULL, NULL);
+   buffer_put_string(buffer, format, utf8, (utf8_length < sizeof(utf8) ? utf8_length : strlen(utf8)));
+}
+
+/**
+ * Exported columns, in order. Record fields come from the schemas so every field of the records is exported.
+ * CSV has one header with the columns of every group, a record only fills the groups it has.
+ * NDJSON objects only have the keys of the record's groups, item payloads are nested objects.
+ */
+#define EXPORT_GROUPS(X) \
+   X(NAME_ID, name_id, struct xi_name_id, XI_SCHEMA_NAME_ID) \
+   X(ABILITY, ability, struct xi_ability, XI_SCHEMA_ABILITY) \
+   X(SPELL, spell, struct xi_spell, XI_SCHEMA_SPELL) \
+   X(ITEM, item, struct xi_item, XI_SCHEMA_ITEM) \
+   X(WEAPON, weapon, struct xi_item_weapon, XI_SCHEMA_ITEM_WEAPON) \
+   X(ARMOR, armor, struct xi_item_armor, XI_SCHEMA_ITEM_ARMOR) \
+   X(PUPPET, puppet, struct xi_item_puppet, XI_SCHEMA_ITEM_PUPPET) \
+   X(GENERAL, general, struct xi_item_general, XI_SCHEMA_ITEM_GENERAL) \
+   X(USABLE, usable, struct xi_item_usable, XI_SCHEMA_ITEM_USABLE)
+
+#define EXPORT_GROUP_ENUM(id, name, type, schema) GROUP_##id,
+
+enum export_group {
+   EXPORT_GROUPS(EXPORT_GROUP_ENUM)
+   GROUP_STRINGS, // item strings
+   GROUP_LAST,
+};
+
+#define EXPORT_COLUMN_NAME(kind, field, offset) #field,
+#define EXPORT_GROUP_COLUMNS(id, name, type, schema) [GROUP_##id] = { #name, (const char*[]){ schema(EXPORT_COLUMN_NAME) NULL } },
+
+static const struct {
+   const char *name;
+   const char **columns;
+} groups[GROUP_LAST] = {
+   EXPORT_GROUPS(EXPORT_GROUP_COLUMNS)
+   [GROUP_STRINGS] = { "item", (const char*[]){ "strings", NULL } },
+};
+
+struct export_record {
+   struct buffer *out;
+   enum format format;
+   bool first; // no separator before the next field
+};
+
+static void
+export_key(struct export_record *record, const char *key)
+{
+   assert(record && key);
+
+   if (!record->first)
+      buffer_put_literal(record->out, ",");
+
+   record->first = false;
+
+   if (record->format == FORMAT_NDJSON) {
+      buffer_put_literal(record->out, "\"");
+      buffer_put(record->out, key, strlen(key));
+      buffer_put_literal(record->out, "\":");
+   }
+}
+
+static void
+export_uint(struct export_record *record, const char *key, const uint64_t value)
+{
+   export_key(record, key);
+   buffer_put_uint(record->out, value);
+}
+
+static void
+export_uint_array(struct export_record *record, const char *key, const uint8_t *values, const size_t count)
+{
+   assert(values);
+
+   export_key(record, key);
+
+   if (record->format == FORMAT_NDJSON) {
+      buffer_put_literal(record->out, "[");
+      for (size_t i = 0; i < count; ++i) {
+         if (i > 0)
+            buffer_put_literal(record->out, ",");
+
+         buffer_put_uint(record->out, values[i]);
+      }
+      buffer_put_literal(record->out, "]");
+      return;
+   }
+
+   // CSV has fixed columns, values share one field separated by spaces
+   for (size_t i = 0; i < count; ++i) {
+      if (i > 0)
+         buffer_put_literal(record->out, " ");
+
+      buffer_put_uint(record->out, values[i]);
+   }
+}
+
+static void
+export_text(struct export_record *record, const char *key, const char *data, const size_t size)
+{
+   export_key(record, key);
+   buffer_put_text(record->out, record->format, data, size);
+}
+
+#define EXPORT_U8(field) export_uint(record, #field, data->field);
+#define EXPORT_U16(field) export_uint(record, #field, data->field);
+#define EXPORT_U32(field) export_uint(record, #field, data->field);
+#define EXPORT_U8_ARRAY(field) export_uint_array(record, #field, data->field, sizeof(data->field));
+#define EXPORT_BYTES(field) export_text(record, #field, data->field, sizeof(data->field));
+#define EXPORT_FIELD(kind, field, offset) EXPORT_##kind(field)
+
+#define EXPORT_GROUP_FUNCTION(id, name, type, schema) \
+   static void \
+   export_##name(struct export_record *record, const type *data) \
+   { \
+      assert(record && data); \
+      schema(EXPORT_FIELD) \
+   }
+
+EXPORT_GROUPS(EXPORT_GROUP_FUNCTION)
+
+static void
+export_end_record(struct buffer *out, const enum format format)
+{
+   if (format == FORMAT_NDJSON) {
+      buffer_put_literal(out, "}\n");
+   } else {
+      buffer_put_literal(out, "\r\n");
+   }
+}
+
+static void
+export_item_strings(struct buffer *out, const enum format format, const struct xi_item *item)
+{
+   assert(out && item);
+
+   if (format == FORMAT_NDJSON) {
+      buffer_put_literal(out, "[");
+      for (uint32_t s = 0; s < item->num_strings; ++s) {
+         if (s > 0)
+            buffer_put_literal(out, ",");
+
+         if (item->strings[s].data) {
+            buffer_put_json_string(out, item->strings[s].data, item->strings[s].length);
+         } else {
+            buffer_put_literal(out, "null");
+         }
+      }
+      buffer_put_literal(out, "]");
+      return;
+   }
+
+   // CSV has fixed columns, strings share one field separated by newlines
+   buffer_put_literal(out, "\"");
+   for (uint32_t s = 0; s < item->num_strings; ++s) {
+      if (s > 0)
+         buffer_put_literal(out, "\n");
+
+      if (item->strings[s].data)
+         buffer_put_csv_escaped(out, item->strings[s].data, item->strings[s].length);
+   }
+   buffer_put_literal(out, "\"");
+}
+
+static enum export_group
+payload_group(const enum xi_item_payload payload)
+{
+   switch (payload) {
+      case XI_ITEM_PAYLOAD_WEAPON: return GROUP_WEAPON;
+      case XI_ITEM_PAYLOAD_ARMOR: return GROUP_ARMOR;
+      case XI_ITEM_PAYLOAD_PUPPET: return GROUP_PUPPET;
+      case XI_ITEM_PAYLOAD_GENERAL: return GROUP_GENERAL;
+      case XI_ITEM_PAYLOAD_USABLE: return GROUP_USABLE;
+      default:break;
+   }
+
+   return GROUP_LAST;
+}
+
+static bool
+group_in_record(const enum export_group group, const struct xi_data *data)
+{
+   assert(data);
+
+   switch (data->type) {
+      case XI_TYPE_NAME_ID: return (group == GROUP_NAME_ID);
+      case XI_TYPE_ABILITY: return (group == GROUP_ABILITY);
+      case XI_TYPE_SPELL: return (group == GROUP_SPELL);
+      case XI_TYPE_ITEM: break;
+      default: return false;
+   }
+
+   if (group == GROUP_ITEM || group == GROUP_STRINGS)
+      return true;
+
+   return (data->item->any && group == payload_group(xi_item_payload_type(data->item->type, data->item->flags)));
+}
+
+static void
+export_group(struct export_record *record, const enum export_group group, const struct xi_data *data)
+{
+   assert(record && data);
+
+   switch (group) {
+      case GROUP_NAME_ID: export_name_id(record, data->name_id); break;
+      case GROUP_ABILITY: export_ability(record, data->ability); break;
+      case GROUP_SPELL: export_spell(record, data->spell); break;
+      case GROUP_ITEM: export_item(record, data->item); break;
+      case GROUP_WEAPON: export_weapon(record, data->item->weapon); break;
+      case GROUP_ARMOR: export_armor(record, data->item->armor); break;
+      case GROUP_PUPPET: export_puppet(record, data->item->puppet); break;
+      case GROUP_GENERAL: export_general(record, data->item->general); break;
+      case GROUP_USABLE: export_usable(record, data->item->usable); break;
+
+      case GROUP_STRINGS:
+         export_key(record, "strings");
+         export_item_strings(record->out, record->format, data->item);
+         break;
+
+      default:
+         break;
+   }
+}
+
+static void
+export_archive(struct buffer *out, const enum format format, const char *path, struct xi_archive *archive)
+{
+   assert(out && path && archive);
+
+   const size_t path_length = strlen(path);
+
+   size_t count;
+   const struct xi_data *data = xi_archive_get_data_list(archive, &count);
+   for (size_t i = 0; i < count; ++i) {
+      if (data[i].type == XI_TYPE_UNKNOWN)
+         continue;
+
+      struct export_record record = { .out = out, .format = format, .first = true };
+
+      if (format == FORMAT_NDJSON)
+         buffer_put_literal(out, "{");
+
+      export_key(&record, "file");
+      buffer_put_string(out, format, path, path_length);
+
+      const char *type = xi_data_type_to_string(data[i].type);
+      export_key(&record, "record");
+      buffer_put_string(out, format, type, strlen(type));
+
+      for (unsigned int g = 0; g < GROUP_LAST; ++g) {
+         if (!group_in_record(g, &data[i])) {
+            // empty columns of groups the record doesn't have
+            for (size_t c = 0; format == FORMAT_CSV && groups[g].columns[c]; ++c)
+               buffer_put_literal(out, ",");
+            continue;
+         }
+
+         if (format == FORMAT_NDJSON && g >= GROUP_WEAPON && g <= GROUP_USABLE) {
+            export_key(&record, groups[g].name);
+            buffer_put_literal(out, "{");
+            record.first = true;
+            export_group(&record, g, &data[i]);
+            buffer_put_literal(out, "}");
+            record.first = false;
+         } else {
+            export_group(&record, g, &data[i]);
+         }
+      }
+
+      export_end_record(out, format);
+   }
+}
+
+static void
+export_header(const enum format format)
+{
+   if (format != FORMAT_CSV)
+      return;
+
+   struct buffer header = {0};
+   buffer_put_literal(&header, "file,record");
+   for (unsigned int g = 0; g < GROUP_LAST; ++g) {
+      for (size_t c = 0; groups[g].columns[c]; ++c) {
+         buffer_put_literal(&header, ",");
+         buffer_put(&header, groups[g].name, strlen(groups[g].name));
+         buffer_put_literal(&header, ".");
+         buffer_put(&header, groups[g].columns[c], strlen(groups[g].columns[c]));
+      }
+   }
+   export_end_record(&header, format);
+
+   if (!header.failed)
+      fwrite(header.data, 1, header.size, stdout);
+
+   free(header.data);
+}
+
+/**
+ * Type map written by --census, "type<TAB>path" per line.
+ * Archives found in it are loaded with XI_LOAD_TYPE_HINT, so detection is skipped.
+ */
+struct type_map_entry {
+   char *path;
+   enum xi_data_type type;
+};
+
+struct type_map {
+   struct type_map_entry *entries;
+   size_t count, allocated;
+};
+
+static int
+type_map_compare(const void *a, const void *b)
+{
+   return strcmp(((const struct type_map_entry*)a)->path, ((const struct type_map_entry*)b)->path);
+}
+
+static void
+type_map_release(struct type_map *map)
+{
+   assert(map);
+
+   for (size_t i = 0; i < map->count; ++i)
+      free(map->entries[i].path);
+
+   free(map->entries);
+   memset(map, 0, sizeof(struct type_map));
+}
+
+static bool
+type_map_add(struct type_map *map, const enum xi_data_type type, const char *path, const size_t length)
+{
+   assert(map && path);
+
+   if (map->count >= map->allocated) {
+      void *tmp;
+      const size_t allocated = (map->allocated ? map->allocated * 2 : 1024);
+      if (!(tmp = realloc(map->entries, allocated * sizeof(struct type_map_entry))))
+         return false;
+
+      map->entries = tmp;
+      map->allocated = allocated;
+   }
+
+   struct type_map_entry *entry = &map->entries[map->count];
+   if (!(entry->path = malloc(length + 1)))
+      return false;
+
+   memcpy(entry->path, path, length);
+   entry->path[length] = 0;
+   entry->type = type;
+   map->count += 1;
+   return true;
+}
+
+static bool
+type_map_load(struct type_map *map, const char *file)
+{
+   assert(map && file);
+
+   FILE *f;
+   if (!(f = fopen(file, "r"))) {
+      fprintf(stderr, "Could not open type map: %s\n", file);
+      return false;
+   }
+
+   char *line = NULL;
+   size_t size = 0, number = 0;
+   ssize_t length;
+   bool ret = true;
+   while (ret && (length = getline(&line, &size, f)) != -1) {
+      ++number;
+
+      if (length > 0 && line[length - 1] == '\n')
+         line[--length] = 0;
+
+      char *path;
+      enum xi_data_type type = XI_TYPE_UNKNOWN;
+      if (!(path = strchr(line, '\t')) || (*path++ = 0, (type = xi_data_type_from_string(line)) == XI_TYPE_UNKNOWN)) {
+         fprintf(stderr, "Malformed type map line %zu: %s\n", number, file);
+         ret = false;
+         break;
+      }
+
+      if (!(ret = type_map_add(map, type, path, length - (path - line))))
+         fprintf(stderr, "Out of memory\n");
+   }
+
+   free(line);
+   fclose(f);
+
+   if (!ret) {
+      type_map_release(map);
+      return false;
+   }
+
+   if (map->count > 0)
+      qsort(map->entries, map->count, sizeof(struct type_map_entry), type_map_compare);
+
+   return true;
+}
+
+static struct xi_load_options
+type_map_load_options(const struct type_map *map, const char *path, const uint32_t flags)
+{
+   assert(map && path);
+
+   struct xi_load_options options = { .flags = flags };
+
+   const struct type_map_entry key = { .path = (char*)path }, *entry;
+   if (map->count > 0 && (entry = bsearch(&key, map->entries, map->count, sizeof(struct type_map_entry), type_map_compare))) {
+      options.flags |= XI_LOAD_TYPE_HINT;
+      options.type = entry->type;
+   }
+
+   return options;
+}
+
+static void*
+export_worker(void *arg)
+{
+   struct export *export = arg;
+
+   // reused for every archive this worker renders
+   struct buffer out = {0};
+
+   pthread_mutex_lock(&export->mutex);
+   while (export->next < export->count) {
+      const size_t index = export->next++;
+      pthread_mutex_unlock(&export->mutex);
+
+      out.size = 0;
+      out.failed = false;
+
+      struct xi_archive *archive;
+      const struct xi_load_options options = type_map_load_options(export->types, export->paths[index], XI_LOAD_UTF8);
+      if ((archive = xi_archive_load_from_file_with_options(export->paths[index], &options))) {
+         export_archive(&out, export->format, export->paths[index], archive);
+         xi_archive_free(archive);
+      }
+
+      // write in argument order, whatever order the workers finish in
+      pthread_mutex_lock(&export->mutex);
+      while (export->written != index)
+         pthread_cond_wait(&export->cond, &export->mutex);
+      pthread_mutex_unlock(&export->mutex);
+
+      bool failed = false;
+      if (!archive) {
+         fprintf(stderr, "Could not load archive: %s\n", export->paths[index]);
+      } else if (out.failed) {
+         fprintf(stderr, "Out of memory while exporting: %s\n", export->paths[index]);
+         failed = true;
+      } else {
+         fwrite(out.data, 1, out.size, stdout);
+      }
+
+      pthread_mutex_lock(&export->mutex);
+      export->ret = (failed ? EXIT_FAILURE : export->ret);
+      export->written = index + 1;
+      pthread_cond_broadcast(&export->cond);
+   }
+   pthread_mutex_unlock(&export->mutex);
+
+   free(out.data);
+   return NULL;
+}
+
+static size_t
+thread_count(size_t threads, const size_t jobs)
+{
+   if (!threads) {
+      const long online = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = (online > 0 ? (size_t)online : 1);
+   }
+
+   // at least one, so callers can size worker arrays with it even without jobs
+   return (threads < jobs ? threads : (jobs > 0 ? jobs : 1));
+}
+
+static int
+export_run(char **paths, const size_t count, const struct type_map *types, const enum format format, size_t threads)
+{
+   assert(paths && count > 0 && types);
+
+   struct export export = {
+      .paths = paths,
+      .count = count,
+      .types = types,
+      .format = format,
+      .ret = EXIT_SUCCESS,
+   };
+
+   threads = thread_count(threads, count);
+
+   pthread_t *workers;
+   if (!(workers = calloc(threads, sizeof(pthread_t)))) {
+      fprintf(stderr, "Out of memory\n");
       return EXIT_FAILURE;
    }
 
-   // xi_ftable_load_from_file(argv[1], argv[2]);
+   export_header(format);
+
+   pthread_mutex_init(&export.mutex, NULL);
+   pthread_cond_init(&export.cond, NULL);
+
+   // calling thread is a worker too, so the export runs even if no thread could be started
+   size_t started = 0;
+   for (; started + 1 < threads && pthread_create(&workers[started], NULL, export_worker, &export) == 0; ++started);
+
+   export_worker(&export);
+
+   for (size_t t = 0; t < started; ++t)
+      pthread_join(workers[t], NULL);
+
+   pthread_cond_destroy(&export.cond);
+   pthread_mutex_destroy(&export.mutex);
+   free(workers);
+   return (fflush(stdout) == 0 ? export.ret : EXIT_FAILURE);
+}
+
+struct census {
+   pthread_mutex_t mutex;
+
+   char **paths;
+   enum xi_data_type *types;
+   size_t count, allocated, next;
+};
+
+static bool
+census_add(struct census *census, const char *path)
+{
+   assert(census && path);
+
+   if (census->count >= census->allocated) {
+      void *tmp;
+      const size_t allocated = (census->allocated ? census->allocated * 2 : 1024);
+      if (!(tmp = realloc(census->paths, allocated * sizeof(char*))))
+         return false;
+
+      census->paths = tmp;
+      census->allocated = allocated;
+   }
+
+   const size_t size = strlen(path) + 1;
+   if (!(census->paths[census->count] = malloc(size)))
+      return false;
+
+   memcpy(census->paths[census->count++], path, size);
+   return true;
+}
 
-   for (int f = 1; f < argc; ++f) {
+static bool
+census_walk(struct census *census, const char *path, const bool follow)
+{
+   assert(census && path);
+
+   struct stat st;
+   if ((follow ? stat(path, &st) : lstat(path, &st)) == -1) {
+      fprintf(stderr, "Could not stat: %s\n", path);
+      return true;
+   }
+
+   // symlinked directories below the given paths are not followed, they may form cycles
+   if (S_ISLNK(st.st_mode) && (stat(path, &st) == -1 || S_ISDIR(st.st_mode)))
+      return true;
+
+   if (S_ISREG(st.st_mode))
+      return census_add(census, path);
+
+   if (!S_ISDIR(st.st_mode))
+      return true;
+
+   DIR *dir;
+   if (!(dir = opendir(path))) {
+      fprintf(stderr, "Could not open directory: %s\n", path);
+      return true;
+   }
+
+   bool ret = true;
+   struct dirent *entry;
+   const size_t length = strlen(path);
+   while (ret && (entry = readdir(dir))) {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+         continue;
+
+      char *child;
+      const size_t size = length + strlen(entry->d_name) + 2;
+      if (!(child = malloc(size))) {
+         ret = false;
+         break;
+      }
+
+      snprintf(child, size, "%s%s%s", path, (length > 0 && path[length - 1] == '/' ? "" : "/"), entry->d_name);
+      ret = census_walk(census, child, false);
+      free(child);
+   }
+
+   closedir(dir);
+   return ret;
+}
+
+static int
+census_compare(const void *a, const void *b)
+{
+   return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void*
+census_worker(void *arg)
+{
+   struct census *census = arg;
+
+   // files are claimed in batches, detection itself is only a pread
+   const size_t batch = 64;
+
+   while (true) {
+      pthread_mutex_lock(&census->mutex);
+      const size_t first = census->next;
+      census->next = (census->count - first > batch ? first + batch : census->count);
+      const size_t last = census->next;
+      pthread_mutex_unlock(&census->mutex);
+
+      if (first >= last)
+         break;
+
+      for (size_t i = first; i < last; ++i)
+         census->types[i] = xi_archive_detect_file(census->paths[i]);
+   }
+
+   return NULL;
+}
+
+static int
+census_run(char **paths, const size_t count, size_t threads)
+{
+   assert(paths);
+
+   int ret = EXIT_FAILURE;
+   struct census census = {0};
+   pthread_t *workers = NULL;
+
+   for (size_t i = 0; i < count; ++i) {
+      if (!census_walk(&census, paths[i], true))
+         goto fail;
+   }
+
+   // sorted so the map is the same for every run over the same tree
+   if (census.count > 0)
+      qsort(census.paths, census.count, sizeof(char*), census_compare);
+
+   threads = thread_count(threads, census.count);
+   if ((census.count > 0 && !(census.types = calloc(census.count, sizeof(enum xi_data_type)))) ||
+       !(workers = calloc(threads, sizeof(pthread_t))))
+      goto fail;
+
+   pthread_mutex_init(&census.mutex, NULL);
+
+   size_t started = 0;
+   for (; started + 1 < threads && pthread_create(&workers[started], NULL, census_worker, &census) == 0; ++started);
+
+   census_worker(&census);
+
+   for (size_t t = 0; t < started; ++t)
+      pthread_join(workers[t], NULL);
+
+   pthread_mutex_destroy(&census.mutex);
+
+   // type map, one "type<TAB>path" line per detected archive
+   size_t totals[XI_TYPE_UNKNOWN + 1] = {0};
+   for (size_t i = 0; i < census.count; ++i) {
+      totals[census.types[i]] += 1;
+
+      if (census.types[i] != XI_TYPE_UNKNOWN)
+         printf("%s\t%s\n", xi_data_type_to_string(census.types[i]), census.paths[i]);
+   }
+
+   for (unsigned int t = 0; t <= XI_TYPE_UNKNOWN; ++t)
+      fprintf(stderr, "%s: %zu\n", xi_data_type_to_string(t), totals[t]);
+
+   ret = (fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+fail:
+   if (ret != EXIT_SUCCESS)
+      fprintf(stderr, "Census failed\n");
+
+   for (size_t i = 0; i < census.count; ++i)
+      free(census.paths[i]);
+
+   free(census.paths);
+   free(census.types);
+   free(workers);
+   return ret;
+}
+
+static int
+text_run(char **paths, const int count, const struct type_map *types)
+{
+   assert(paths && types);
+
+   for (int f = 0; f < count; ++f) {
       struct xi_archive *archive;
-      if (!(archive = xi_archive_load_from_file(argv[f]))) {
-         fprintf(stderr, "Could not load archive: %s\n", argv[f]);
+      const struct xi_load_options options = type_map_load_options(types, paths[f], 0);
+      if (!(archive = xi_archive_load_from_file_with_options(paths[f], &options))) {
+         fprintf(stderr, "Could not load archive: %s\n", paths[f]);
          continue;
       }
 
-      size_t count;
-      const struct xi_data *data = xi_archive_get_data_list(archive, &count);
-      for (size_t i = 0; i < count; ++i) {
+      size_t num_data;
+      const struct xi_data *data = xi_archive_get_data_list(archive, &num_data);
+      for (size_t i = 0; i < num_data; ++i) {
          switch (data->type) {
             case XI_TYPE_NAME_ID: {
                   struct xi_name_id *name_id = data[i].name_id;
@@ -85,3 +950,68 @@ main(int argc, char **argv)
 
    return EXIT_SUCCESS;
 }
+
+static void
+usage(const char *name)
+{
+   fprintf(stderr, "usage: %s [--format=text|ndjson|csv] [--threads=N] [--types=map] file.dat...\n", name);
+   fprintf(stderr, "       %s --census [--threads=N] directory... > map\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+   size_t threads = 0;
+   bool census = false;
+   const char *types = NULL;
+   enum format format = FORMAT_TEXT;
+
+   int f = 1;
+   for (; f < argc && !strncmp(argv[f], "--", 2); ++f) {
+      if (!strcmp(argv[f], "--")) {
+         ++f;
+         break;
+      } else if (!strcmp(argv[f], "--format=text")) {
+         format = FORMAT_TEXT;
+      } else if (!strcmp(argv[f], "--format=ndjson")) {
+         format = FORMAT_NDJSON;
+      } else if (!strcmp(argv[f], "--format=csv")) {
+         format = FORMAT_CSV;
+      } else if (!strcmp(argv[f], "--census")) {
+         census = true;
+      } else if (!strncmp(argv[f], "--threads=", 10)) {
+         threads = strtoul(argv[f] + 10, NULL, 10);
+      } else if (!strncmp(argv[f], "--types=", 8)) {
+         types = argv[f] + 8;
+      } else {
+         usage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (f >= argc) {
+      usage(argv[0]);
+      fprintf(stderr, "Supply some dat file paths as argument.\n");
+      return EXIT_FAILURE;
+   }
+
+   // xi_ftable_load_from_file(argv[1], argv[2]);
+
+   if (census)
+      return census_run(argv + f, argc - f, threads);
+
+   // paths are looked up as given, so pass them the same way as to the census
+   struct type_map map = {0};
+   if (types && !type_map_load(&map, types))
+      return EXIT_FAILURE;
+
+   int ret;
+   if (format == FORMAT_TEXT) {
+      ret = text_run(argv + f, argc - f, &map);
+   } else {
+      ret = export_run(argv + f, argc - f, &map, format, threads);
+   }
+
+   type_map_release(&map);
+   return ret;
+}
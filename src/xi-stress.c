@@ -0,0 +1,507 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "xi.h"
+
+// latency samples kept per thread, reservoir sampled past this
+#define SAMPLES 65536
+
+struct options {
+   unsigned int readers, writers, archives, seconds;
+   size_t budget;
+};
+
+struct worker {
+   pthread_t thread;
+   struct xi_cache *cache;
+   char **paths;
+   const struct options *options;
+   uint64_t deadline, seed;
+
+   uint64_t ops, failures, seen;
+   uint64_t *samples;
+   size_t num_samples;
+   bool started;
+};
+
+static uint64_t
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+next_random(uint64_t *state)
+{
+   // xorshift64*
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return x * 2685821657736338717ull;
+}
+
+static void
+put_u16(uint8_t *p, const uint16_t v)
+{
+   p[0] = v & 0xFF;
+   p[1] = v >> 8;
+}
+
+static void
+put_u32(uint8_t *p, const uint32_t v)
+{
+   put_u16(p, v & 0xFFFF);
+   put_u16(p + 2, v >> 16);
+}
+
+static uint8_t
+rotate_left(const uint8_t b, const int count)
+{
+   return (uint8_t)((b << count) | (b >> ((8 - count) & 7)));
+}
+
+static void
+encrypt(uint8_t *data, const size_t size, const int rot)
+{
+   for (size_t i = 0; i < size; ++i)
+      data[i] = rotate_left(data[i], rot);
+}
+
+static int
+countbits(uint8_t byte)
+{
+   int bits = 0;
+   for (; byte; byte &= byte - 1)
+      ++bits;
+   return bits;
+}
+
+static int
+variable_rotation(const uint8_t *data)
+{
+   // same as rotation_for_variable_encryption in xi.c, bit counts survive rotation
+   static const int rotations[5] = { 7, 1, 6, 2, 5 };
+   const int seed = countbits(data[2]) - countbits(data[11]) + countbits(data[12]);
+   return rotations[abs(seed) % 5];
+}
+
+static size_t
+generate_name_id(uint8_t *data, const uint64_t seed)
+{
+   const size_t count = 1024;
+   for (size_t i = 0; i < count; ++i) {
+      uint8_t *p = data + i * 32;
+      if (i == 0) {
+         memcpy(p, "none", 4);
+      } else {
+         snprintf((char*)p, 28, "Npc%zu_%u", i, (unsigned int)(seed % 1000));
+         put_u32(p + 28, 0x01000000 | (i & 0xFFF));
+      }
+   }
+   return count * 32;
+}
+
+static size_t
+generate_ability(uint8_t *data, const uint64_t seed)
+{
+   const size_t count = 256;
+   for (size_t i = 0; i < count; ++i) {
+      uint8_t *p = data + i * 0x400;
+      put_u16(p + 0x00, i);
+      put_u16(p + 0x02, (i == 0 ? 11776 : seed + i));
+      put_u16(p + 0x04, (i == 0 ? 0 : i * 3));
+      put_u16(p + 0x08, 1);
+
+      if (i == 0) {
+         p[0x0A] = p[0x2A] = '.';
+      } else {
+         snprintf((char*)p + 0x0A, 32, "Ability %zu", i);
+         snprintf((char*)p + 0x2A, 256, "Description of ability %zu.", i);
+      }
+
+      encrypt(p, 0x400, variable_rotation(p));
+   }
+   return count * 0x400;
+}
+
+static size_t
+generate_spell(uint8_t *data, const uint64_t seed)
+{
+   const size_t count = 256;
+   for (size_t i = 0; i < count; ++i) {
+      uint8_t *p = data + i * 0x400;
+      put_u16(p + 0x00, i);
+      put_u16(p + 0x02, (i == 0 ? 0 : 1 + i % 6));
+      put_u16(p + 0x04, (i == 0 ? 6 : i % 8));
+      put_u16(p + 0x06, 63);
+      put_u16(p + 0x08, (i == 0 ? 32 : 32 + i % 12));
+      put_u16(p + 0x0A, (i == 0 ? 0 : (seed + i) % 200));
+
+      for (unsigned int j = 0; j < 24; ++j)
+         p[0x0E + j] = (i == 0 || j == 0 || (i + j) % 3 ? 0xFF : (i + j) % 99 + 1);
+
+      put_u16(p + 0x26, i);
+      snprintf((char*)p + 0x3D, 20, "Spell %zu", i);
+      snprintf((char*)p + 0xD1, 128, "Description of spell %zu.", i);
+      encrypt(p, 0x400, variable_rotation(p));
+   }
+   return count * 0x400;
+}
+
+static size_t
+generate_item(uint8_t *data, const uint64_t seed)
+{
+   const size_t count = 512;
+   for (size_t i = 0; i < count; ++i) {
+      uint8_t *p = data + i * 0xC00;
+      const bool weapon = (i % 4 == 0);
+      put_u32(p + 0x00, 0x1000 + i);
+      put_u16(p + 0x04, 0);
+      put_u16(p + 0x06, 12);
+      put_u16(p + 0x08, (weapon ? XI_ITEM_TYPE_WEAPON : XI_ITEM_TYPE_ITEM));
+      put_u16(p + 0x0A, seed % 0xFFFF);
+      put_u16(p + 0x0C, 1);
+
+      // weapon payload is left zeroed apart from level
+      uint8_t *strings = p + 0x0E + (weapon ? 34 : 0);
+      if (weapon)
+         put_u16(p + 0x0E, i % 99);
+
+      // uint32_t count, { uint32_t offset, uint32_t flags }[count], { uint32_t 1, uint32_t padding[6], char string[] }
+      char text[2][64];
+      snprintf(text[0], sizeof(text[0]), "Item %zu", i);
+      snprintf(text[1], sizeof(text[1]), "Description of item %zu.", i);
+
+      uint32_t offset = 4 + 2 * 8;
+      put_u32(strings, 2);
+      for (unsigned int s = 0; s < 2; ++s) {
+         put_u32(strings + 4 + s * 8, offset);
+         put_u32(strings + offset, 1);
+         memcpy(strings + offset + 28, text[s], strlen(text[s]) + 1);
+         offset += (28 + strlen(text[s]) + 1 + 3) & ~3u;
+      }
+
+      encrypt(p, 0xC00, 5);
+   }
+   return count * 0xC00;
+}
+
+static bool
+generate(const char *path, const unsigned int archive, const uint64_t seed)
+{
+   assert(path);
+
+   static size_t (*generators[])(uint8_t *data, const uint64_t seed) = {
+      generate_name_id,
+      generate_ability,
+      generate_spell,
+      generate_item,
+   };
+
+   uint8_t *data;
+   const size_t max_size = 512 * 0xC00;
+   if (!(data = calloc(1, max_size)))
+      return false;
+
+   const size_t size = generators[archive % 4](data, seed);
+
+   // written aside and renamed over, so loads never see half written file
+   char tmp[4096];
+   snprintf(tmp, sizeof(tmp), "%s.%llx.tmp", path, (unsigned long long)seed);
+
+   FILE *f;
+   bool ret = false;
+   if ((f = fopen(tmp, "wb"))) {
+      ret = (fwrite(data, 1, size, f) == size);
+      ret = (fclose(f) == 0 && ret && rename(tmp, path) == 0);
+   }
+
+   if (!ret)
+      remove(tmp);
+
+   free(data);
+   return ret;
+}
+
+static void
+record_sample(struct worker *worker, const uint64_t ns)
+{
+   assert(worker);
+
+   worker->seen += 1;
+   if (worker->num_samples < SAMPLES) {
+      worker->samples[worker->num_samples++] = ns;
+   } else {
+      const uint64_t slot = next_random(&worker->seed) % worker->seen;
+      if (slot < SAMPLES)
+         worker->samples[slot] = ns;
+   }
+}
+
+static uint64_t
+touch_record(const struct xi_data *data)
+{
+   assert(data);
+
+   switch (data->type) {
+      case XI_TYPE_NAME_ID: return data->name_id->id + (uint8_t)data->name_id->name[0];
+      case XI_TYPE_ABILITY: return data->ability->icon_id + (uint8_t)data->ability->name[0];
+      case XI_TYPE_SPELL: return data->spell->mp_cost + data->spell->level[1];
+      case XI_TYPE_ITEM: return data->item->id + (data->item->num_strings > 0 ? data->item->strings[0].length : 0);
+      default:break;
+   }
+
+   return 0;
+}
+
+static void*
+reader_run(void *arg)
+{
+   struct worker *worker = arg;
+   uint64_t sink = 0;
+
+   while (now() < worker->deadline) {
+      const uint64_t start = now();
+      const char *path = worker->paths[next_random(&worker->seed) % worker->options->archives];
+
+      struct xi_archive *archive;
+      if (!(archive = xi_cache_get(worker->cache, path))) {
+         worker->failures += 1;
+         continue;
+      }
+
+      size_t count;
+      const struct xi_data *data = xi_archive_get_data_list(archive, &count);
+      for (unsigned int i = 0; i < 8 && count > 0; ++i)
+         sink += touch_record(&data[next_random(&worker->seed) % count]);
+
+      xi_cache_release(worker->cache, archive);
+      record_sample(worker, now() - start);
+      worker->ops += 1;
+   }
+
+   // keeps the accesses from being optimized out
+   worker->seed ^= sink;
+   return NULL;
+}
+
+static void*
+writer_run(void *arg)
+{
+   struct worker *worker = arg;
+
+   while (now() < worker->deadline) {
+      const unsigned int archive = next_random(&worker->seed) % worker->options->archives;
+      const char *path = worker->paths[archive];
+
+      if (!generate(path, archive, next_random(&worker->seed))) {
+         worker->failures += 1;
+         continue;
+      }
+
+      // readers holding the old archive keep it until they release it
+      xi_cache_invalidate(worker->cache, path);
+
+      struct xi_archive *loaded;
+      if ((loaded = xi_cache_get(worker->cache, path))) {
+         xi_cache_release(worker->cache, loaded);
+      } else {
+         worker->failures += 1;
+      }
+
+      worker->ops += 1;
+   }
+
+   return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+   const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+   return (x > y) - (x < y);
+}
+
+static bool
+run(char **paths, const struct options *options, const unsigned int readers)
+{
+   assert(paths && options);
+
+   struct xi_cache *cache;
+   if (!(cache = xi_cache_new(options->budget, NULL, NULL)))
+      return false;
+
+   const unsigned int total = readers + options->writers;
+
+   struct worker *workers;
+   if (!(workers = calloc(total, sizeof(struct worker)))) {
+      xi_cache_free(cache);
+      return false;
+   }
+
+   bool ret = true;
+   const uint64_t start = now(), deadline = start + (uint64_t)options->seconds * 1000000000;
+   for (unsigned int t = 0; t < total; ++t) {
+      struct worker *w = &workers[t];
+      w->cache = cache;
+      w->paths = paths;
+      w->options = options;
+      w->deadline = deadline;
+      w->seed = 0x9E3779B97F4A7C15ull * (t + 1);
+
+      if (t < readers && !(w->samples = malloc(SAMPLES * sizeof(uint64_t)))) {
+         ret = false;
+         break;
+      }
+
+      if (!(w->started = !pthread_create(&w->thread, NULL, (t < readers ? reader_run : writer_run), w))) {
+         ret = false;
+         break;
+      }
+   }
+
+   for (unsigned int t = 0; t < total; ++t) {
+      if (workers[t].started)
+         pthread_join(workers[t].thread, NULL);
+   }
+
+   const double elapsed = (now() - start) / 1e9;
+
+   uint64_t ops = 0, reloads = 0, failures = 0;
+   size_t num_samples = 0;
+   for (unsigned int t = 0; t < total; ++t) {
+      if (t < readers) {
+         ops += workers[t].ops;
+         num_samples += workers[t].num_samples;
+      } else {
+         reloads += workers[t].ops;
+      }
+      failures += workers[t].failures;
+   }
+
+   uint64_t *samples;
+   if (ret && (samples = malloc((num_samples > 0 ? num_samples : 1) * sizeof(uint64_t)))) {
+      size_t n = 0;
+      for (unsigned int t = 0; t < readers; ++t) {
+         memcpy(samples + n, workers[t].samples, workers[t].num_samples * sizeof(uint64_t));
+         n += workers[t].num_samples;
+      }
+
+      qsort(samples, n, sizeof(uint64_t), compare_u64);
+
+#define PERCENTILE(p) (n > 0 ? samples[(size_t)((n - 1) * (p))] / 1e3 : 0.0)
+      struct xi_cache_stats stats;
+      xi_cache_get_stats(cache, &stats);
+      printf("%7u %7u %12.0f %10.2f %10.2f %10.2f %10.0f %8llu %8llu\n",
+            readers, options->writers, ops / elapsed, PERCENTILE(0.5), PERCENTILE(0.99), PERCENTILE(0.999),
+            reloads / elapsed, (unsigned long long)stats.evictions, (unsigned long long)failures);
+#undef PERCENTILE
+
+      free(samples);
+   } else {
+      ret = false;
+   }
+
+   for (unsigned int t = 0; t < total; ++t)
+      free(workers[t].samples);
+
+   free(workers);
+   xi_cache_free(cache);
+   return (ret && !failures);
+}
+
+static void
+usage(const char *name)
+{
+   fprintf(stderr, "usage: %s [--readers=N] [--writers=M] [--archives=K] [--seconds=S] [--budget=bytes]\n", name);
+   fprintf(stderr, "Runs 1, 2, 4 .. N reader threads against M threads replacing archives, each for S seconds.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+   struct options options = {
+      .readers = 8,
+      .writers = 2,
+      .archives = 16,
+      .seconds = 2,
+      .budget = 4 * 1024 * 1024,
+   };
+
+   for (int i = 1; i < argc; ++i) {
+      if (!strncmp(argv[i], "--readers=", 10)) {
+         options.readers = strtoul(argv[i] + 10, NULL, 10);
+      } else if (!strncmp(argv[i], "--writers=", 10)) {
+         options.writers = strtoul(argv[i] + 10, NULL, 10);
+      } else if (!strncmp(argv[i], "--archives=", 11)) {
+         options.archives = strtoul(argv[i] + 11, NULL, 10);
+      } else if (!strncmp(argv[i], "--seconds=", 10)) {
+         options.seconds = strtoul(argv[i] + 10, NULL, 10);
+      } else if (!strncmp(argv[i], "--budget=", 9)) {
+         options.budget = strtoull(argv[i] + 9, NULL, 10);
+      } else {
+         usage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (!options.readers || !options.archives) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   char dir[] = "/tmp/xi-stress-XXXXXX";
+   if (!mkdtemp(dir)) {
+      fprintf(stderr, "Could not create directory for synthetic archives.\n");
+      return EXIT_FAILURE;
+   }
+
+   int ret = EXIT_FAILURE;
+   char **paths;
+   if (!(paths = calloc(options.archives, sizeof(char*))))
+      goto out;
+
+   for (unsigned int i = 0; i < options.archives; ++i) {
+      if (!(paths[i] = malloc(sizeof(dir) + 16)))
+         goto out;
+
+      snprintf(paths[i], sizeof(dir) + 16, "%s/%u.DAT", dir, i);
+      if (!generate(paths[i], i, i + 1)) {
+         fprintf(stderr, "Could not write synthetic archive: %s\n", paths[i]);
+         goto out;
+      }
+   }
+
+   printf("%7s %7s %12s %10s %10s %10s %10s %8s %8s\n", "readers", "writers", "ops/s", "p50(us)", "p99(us)", "p999(us)", "reloads/s", "evicted", "failed");
+
+   ret = EXIT_SUCCESS;
+   // powers of two below the requested count, then the requested count itself
+   for (unsigned int readers = 1;; readers = (readers > options.readers / 2 ? options.readers : readers * 2)) {
+      if (!run(paths, &options, readers))
+         ret = EXIT_FAILURE;
+
+      if (readers == options.readers)
+         break;
+   }
+
+out:
+   for (unsigned int i = 0; paths && i < options.archives; ++i) {
+      if (paths[i])
+         remove(paths[i]);
+      free(paths[i]);
+   }
+
+   free(paths);
+   rmdir(dir);
+   return ret;
+}
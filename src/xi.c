@@ -1,19 +1,74 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "xi.h"
-#include "buffer/buffer.h"
-#include "pool/pool.h"
+#include "schema.h"
+#include "allocator.h"
 
 #ifndef MIN
 #  define MIN(a,b) (((a)<(b))?(a):(b))
 #endif
 
+#ifndef MAX
+#  define MAX(a,b) (((a)>(b))?(a):(b))
+#endif
+
+struct xi_string_pool {
+   uint8_t *data;
+   size_t size, allocated;
+};
+
+/**
+ * Growable array of fixed size members, allocated with the owner's allocator.
+ */
+struct xi_array {
+   uint8_t *data;
+   size_t count, allocated, member;
+};
+
+#define XI_SPELL_JOBS 24
+
+/**
+ * Spells of each distinct value of a field (element, skill), one bitset per value.
+ */
+struct xi_spell_values {
+   uint16_t *values; // sorted
+   uint64_t *bits; // bitset of values[v] is bits[v * words..]
+   size_t count;
+};
+
+/**
+ * Learnability index of spell archives, see xi_archive_query_spells.
+ * Bitsets have a bit per spell and are words long.
+ */
+struct xi_spell_index {
+   // rows of job j are level_offsets[j]..level_offsets[j + 1], one per distinct level the job learns spells at
+   // row's bitset has every spell the job learns at or below levels[row]
+   uint8_t *levels;
+   uint64_t *learned; // bitset of row r is learned[r * words..]
+   size_t level_offsets[XI_SPELL_JOBS + 1];
+
+   struct xi_spell_values elements, skills;
+   size_t count, words;
+};
+
 struct xi_archive {
-   chckIterPool *data;
+   struct xi_allocator allocator;
+   enum xi_data_type type;
+   struct xi_array data;
+   struct xi_array compact;
+   enum xi_data_type compact_type;
+   struct xi_string_pool strings;
+   struct xi_spell_index spells;
+   struct xi_load_options options;
 };
 
 struct xi_file_entry {
@@ -22,41 +77,55 @@ struct xi_file_entry {
 };
 
 struct xi_ftable {
-   chckIterPool *data;
+   struct xi_allocator allocator;
+   struct xi_array data;
 };
 
 static const size_t xi_data_sizes[] = {
    sizeof(struct xi_name_id), // XI_TYPE_NAME_ID,
    sizeof(struct xi_ability), // XI_TYPE_ABILITY,
-   sizeof(struct xi_ability), // XI_TYPE_SPELL,
+   sizeof(struct xi_spell),   // XI_TYPE_SPELL,
    sizeof(struct xi_item),    // XI_TYPE_ITEM,
    0,                         // XI_TYPE_UNKNOWN,
 };
 
-static void
-id_to_path(const uint16_t id, char path[20])
+static const size_t xi_compact_sizes[] = {
+   0,                                 // XI_TYPE_NAME_ID,
+   sizeof(struct xi_ability_compact), // XI_TYPE_ABILITY,
+   sizeof(struct xi_spell_compact),   // XI_TYPE_SPELL,
+   0,                                 // XI_TYPE_ITEM,
+   0,                                 // XI_TYPE_UNKNOWN,
+};
+
+void
+xi_id_to_path(const uint16_t id, char path[20])
 {
    memset(path, 0, 20);
-   snprintf(path, 20, "ROM\\%u\\%u.DAT", id >> 7, id & 0x7F);
+   snprintf(path, 20, "ROM/%u/%u.DAT", id >> 7, id & 0x7F);
 }
 
-static uint8_t
-rotate_right(uint8_t b, int count)
+static inline uint8_t
+rotate_right(const uint8_t b, const int count)
 {
-   for (; count > 0; --count) {
-      if ((b & 0x01) == 0x01) {
-         b >>= 1; // if the last bit is 1 (ex. 00000001, it needs to be dropped
-         b |= 0x80; // and then set as the first bit (ex. 10000000)
-      } else b >>= 1; // if the last bit is not 1 (set), just rotate as normal.
-   }
-   return b;
+   assert(count >= 0 && count < 8);
+   return (uint8_t)((b >> count) | (b << (8 - count)));
+}
+
+static inline uint32_t
+rotate_bytes_right(const uint32_t x, const int count)
+{
+   // rotates each byte of x separately
+   assert(count >= 0 && count < 8);
+   const uint32_t low = 0x01010101u * (0xFFu >> count);
+   return ((x >> count) & low) | ((x << (8 - count)) & ~low);
 }
 
 static void
-decode(uint8_t *data, const size_t size, const int count)
+decode_copy(void *dst, const uint8_t *src, const size_t size, const int count)
 {
+   uint8_t *out = dst;
    for (size_t i = 0; i < size; ++i)
-      data[i] = rotate_right(data[i], count);
+      out[i] = rotate_right(src[i], count);
 }
 
 static int
@@ -110,10 +179,61 @@ rotation_for_variable_encryption(const uint8_t *data, const size_t size)
    return 0;
 }
 
+static void
+array_init(struct xi_array *array, const size_t member)
+{
+   assert(array && member > 0);
+   memset(array, 0, sizeof(struct xi_array));
+   array->member = member;
+}
+
 static void*
-data_from_file(const char *file, size_t *out_size)
+array_add(struct xi_array *array, const struct xi_allocator *allocator, const void *member)
 {
-   assert(file && out_size);
+   assert(array && array->member > 0 && allocator && member);
+
+   if (array->count >= array->allocated) {
+      const size_t allocated = (array->allocated > 0 ? array->allocated * 2 : 32);
+      if (allocated > SIZE_MAX / array->member)
+         return NULL;
+
+      void *tmp;
+      if (!(tmp = xi_realloc(allocator, array->data, allocated * array->member)))
+         return NULL;
+
+      array->data = tmp;
+      array->allocated = allocated;
+   }
+
+   void *ptr = array->data + array->count++ * array->member;
+   memcpy(ptr, member, array->member);
+   return ptr;
+}
+
+static void*
+array_get(const struct xi_array *array, size_t *out_count)
+{
+   assert(array);
+
+   if (out_count)
+      *out_count = array->count;
+
+   return (array->count > 0 ? array->data : NULL);
+}
+
+static void
+array_release(struct xi_array *array, const struct xi_allocator *allocator)
+{
+   assert(array && allocator);
+   xi_free(allocator, array->data);
+   array->data = NULL;
+   array->count = array->allocated = 0;
+}
+
+static void*
+data_from_file(const struct xi_allocator *allocator, const char *file, size_t *out_size)
+{
+   assert(allocator && file && out_size);
 
    FILE *f;
    void *data = NULL;
@@ -126,7 +246,7 @@ data_from_file(const char *file, size_t *out_size)
    *out_size = ftell(f);
    fseek(f, 0L, SEEK_SET);
 
-   if (!(data = malloc(*out_size)))
+   if (!(data = xi_alloc(allocator, *out_size)))
       goto fail;
 
    fread(data, 1, *out_size, f);
@@ -136,44 +256,39 @@ data_from_file(const char *file, size_t *out_size)
 fail:
    if (f)
       fclose(f);
-   free(data);
+   xi_free(allocator, data);
    return NULL;
 }
 
 static void
-item_free(struct xi_item *item)
+item_release(const struct xi_allocator *allocator, struct xi_item *item)
 {
-   assert(item);
+   assert(allocator && item);
 
    for (uint32_t i = 0; i < item->num_strings; ++i)
-      free(item->strings[i].data);
+      xi_free(allocator, item->strings[i].data);
 
-   free(item->strings);
-   free(item->any);
-   free(item);
+   xi_free(allocator, item->strings);
+   xi_free(allocator, item->any);
 }
 
 static void
-data_free(struct xi_data *data)
+data_free(const struct xi_allocator *allocator, struct xi_data *data)
 {
-   assert(data);
+   assert(allocator && data);
 
-   switch (data->type) {
-      case XI_TYPE_ITEM:
-         item_free(data->item);
-         break;
-      default:
-         free(data->any);
-         break;
-   }
+   if (data->type == XI_TYPE_ITEM && data->item)
+      item_release(allocator, data->item);
+
+   xi_free(allocator, data->any);
 }
 
 static int
-item_set_data(struct xi_item *item, const size_t size, const void *data)
+item_set_data(const struct xi_allocator *allocator, struct xi_item *item, const size_t size, const void *data)
 {
-   assert(item && size && data);
+   assert(allocator && item && size && data);
 
-   if (!(item->any = malloc(size)))
+   if (!(item->any = xi_alloc(allocator, size)))
       return 0;
 
    memcpy(item->any, data, size);
@@ -187,40 +302,224 @@ archive_add_data(struct xi_archive *archive, const enum xi_data_type type, const
 
    void *copy = NULL;
    if (type != XI_TYPE_UNKNOWN) {
-      if (!(copy = malloc(xi_data_sizes[type])))
+      if (!(copy = xi_alloc(&archive->allocator, xi_data_sizes[type])))
          return 0;
 
       memcpy(copy, data, xi_data_sizes[type]);
    }
 
-   struct xi_data *xi_data;
-   if ((xi_data = chckIterPoolAdd(archive->data, &xi_data, NULL))) {
-      xi_data->type = type;
-      xi_data->any = copy;
+   struct xi_data xi_data = {
+      .type = type,
+      .any = copy,
+   };
+
+   if (!array_add(&archive->data, &archive->allocator, &xi_data)) {
+      xi_free(&archive->allocator, copy);
+      return 0;
+   }
+
+   return 1;
+}
+
+static int
+string_pool_add(struct xi_string_pool *pool, const struct xi_allocator *allocator, const char *data, const size_t length, uint32_t *out_ref)
+{
+   assert(pool && allocator && (data || !length) && out_ref);
+
+   // entries are uint16_t little endian length + bytes + \0
+   const size_t needed = pool->size + sizeof(uint16_t) + length + 1;
+   if (length > 0xFFFF || needed > UINT32_MAX)
+      return 0;
+
+   if (needed > pool->allocated) {
+      size_t allocated = (pool->allocated > 0 ? pool->allocated : 1024);
+      while (allocated < needed)
+         allocated *= 2;
+
+      void *tmp;
+      if (!(tmp = xi_realloc(allocator, pool->data, allocated)))
+         return 0;
+
+      pool->data = tmp;
+      pool->allocated = allocated;
+   }
+
+   uint8_t *entry = pool->data + pool->size;
+   entry[0] = length & 0xFF;
+   entry[1] = (length >> 8) & 0xFF;
+   memcpy(entry + sizeof(uint16_t), data, length);
+   entry[sizeof(uint16_t) + length] = 0;
+
+   *out_ref = pool->size;
+   pool->size = needed;
+   return 1;
+}
+
+static void
+string_pool_shrink(struct xi_string_pool *pool, const struct xi_allocator *allocator)
+{
+   assert(pool && allocator);
+
+   if (pool->size == pool->allocated)
+      return;
+
+   void *tmp;
+   if (pool->size > 0 && (tmp = xi_realloc(allocator, pool->data, pool->size))) {
+      pool->data = tmp;
+      pool->allocated = pool->size;
+   }
+}
+
+static size_t
+text_to_utf8(const struct xi_load_options *options, const char *data, const size_t length, char *out, const size_t out_size)
+{
+   assert(options);
+   return xi_sjis_to_utf8(data, length, out, out_size, options->autotranslate, options->userdata);
+}
+
+static char*
+text_dup(const struct xi_allocator *allocator, const struct xi_load_options *options, const char *data, const size_t length, size_t *out_length)
+{
+   assert(allocator && options && data && out_length);
+
+   char *copy;
+   if (!(options->flags & XI_LOAD_UTF8)) {
+      if (!(copy = xi_calloc(allocator, 1, length + 1)))
+         return NULL;
+
+      memcpy(copy, data, length);
+      *out_length = length;
+      return copy;
+   }
+
+   // transcode once into stack, only huge auto-translate expansions need second pass
+   char utf8[4096];
+   size_t utf8_length = text_to_utf8(options, data, length, utf8, sizeof(utf8));
+
+   if (!(copy = xi_alloc(allocator, utf8_length + 1)))
+      return NULL;
+
+   if (utf8_length < sizeof(utf8)) {
+      memcpy(copy, utf8, utf8_length + 1);
+   } else {
+      text_to_utf8(options, data, length, copy, utf8_length + 1);
+   }
+
+   *out_length = utf8_length;
+   return copy;
+}
+
+static int
+archive_add_string(struct xi_archive *archive, const char *data, const size_t max_length, uint32_t *out_ref)
+{
+   assert(archive && data && out_ref);
+
+   // text fields are fixed width, and not always \0 terminated
+   size_t length = 0;
+   while (length < max_length && data[length] != 0)
+      ++length;
+
+   if (!(archive->options.flags & XI_LOAD_UTF8))
+      return string_pool_add(&archive->strings, &archive->allocator, data, length, out_ref);
+
+   char utf8[4096];
+   size_t utf8_length = text_to_utf8(&archive->options, data, length, utf8, sizeof(utf8));
+   return string_pool_add(&archive->strings, &archive->allocator, utf8, MIN(utf8_length, sizeof(utf8) - 1), out_ref);
+}
+
+static int
+archive_add_compact(struct xi_archive *archive, const enum xi_data_type type, const void *data)
+{
+   assert(archive && xi_compact_sizes[type] > 0 && data);
+
+   if (!archive->compact.member) {
+      array_init(&archive->compact, xi_compact_sizes[type]);
+      archive->compact_type = type;
+   }
+
+   assert(archive->compact_type == type);
+   return (array_add(&archive->compact, &archive->allocator, data) != NULL);
+}
+
+static int
+archive_add_ability(struct xi_archive *archive, const struct xi_ability *ability)
+{
+   assert(archive && ability);
+
+   if (!(archive->options.flags & XI_LOAD_COMPACT))
+      return archive_add_data(archive, XI_TYPE_ABILITY, ability);
+
+   struct xi_ability_compact compact = {
+      .index = ability->index,
+      .icon_id = ability->icon_id,
+      .mp_cost = ability->mp_cost,
+      .unknown = ability->unknown,
+      .targets = ability->targets,
+   };
+
+   if (!archive_add_string(archive, ability->name, sizeof(ability->name), &compact.name) ||
+       !archive_add_string(archive, ability->description, sizeof(ability->description), &compact.description))
+      return 0;
+
+   return archive_add_compact(archive, XI_TYPE_ABILITY, &compact);
+}
+
+static int
+archive_add_spell(struct xi_archive *archive, const struct xi_spell *spell)
+{
+   assert(archive && spell);
+
+   if (!(archive->options.flags & XI_LOAD_COMPACT))
+      return archive_add_data(archive, XI_TYPE_SPELL, spell);
+
+   struct xi_spell_compact compact = {
+      .index = spell->index,
+      .type = spell->type,
+      .element = spell->element,
+      .targets = spell->targets,
+      .skill = spell->skill,
+      .mp_cost = spell->mp_cost,
+      .id = spell->id,
+      .casting_time = spell->casting_time,
+      .recast_delay = spell->recast_delay,
+      .unknown = spell->unknown,
+   };
+
+   memcpy(compact.level, spell->level, sizeof(compact.level));
+
+   int ret;
+   if (archive->options.language == XI_LANGUAGE_JAPANESE) {
+      ret = archive_add_string(archive, spell->jp_name, sizeof(spell->jp_name), &compact.name) &&
+            archive_add_string(archive, spell->jp_description, sizeof(spell->jp_description), &compact.description);
    } else {
-      free(copy);
+      ret = archive_add_string(archive, spell->en_name, sizeof(spell->en_name), &compact.name) &&
+            archive_add_string(archive, spell->en_description, sizeof(spell->en_description), &compact.description);
    }
 
-   return (xi_data != NULL);
+   return ret && archive_add_compact(archive, XI_TYPE_SPELL, &compact);
 }
 
 struct xi_archive*
-xi_archive_new(void)
+xi_archive_new_with_allocator(const struct xi_allocator *allocator)
 {
    struct xi_archive *archive;
 
-   if (!(archive = calloc(1, sizeof(struct xi_archive))))
-      goto fail;
+   if (!allocator)
+      allocator = &xi_default_allocator;
 
-   if (!(archive->data = chckIterPoolNew(30, 0, sizeof(struct xi_data))))
-      goto fail;
+   if (!(archive = xi_calloc(allocator, 1, sizeof(struct xi_archive))))
+      return NULL;
 
+   archive->allocator = *allocator;
+   archive->type = XI_TYPE_UNKNOWN;
+   array_init(&archive->data, sizeof(struct xi_data));
    return archive;
+}
 
-fail:
-   if (archive)
-      xi_archive_free(archive);
-   return NULL;
+struct xi_archive*
+xi_archive_new(void)
+{
+   return xi_archive_new_with_allocator(NULL);
 }
 
 void
@@ -228,412 +527,1031 @@ xi_archive_free(struct xi_archive *archive)
 {
    assert(archive);
 
-   if (archive->data) {
-      chckIterPoolIterCall(archive->data, data_free);
-      chckIterPoolFree(archive->data);
+   const struct xi_allocator allocator = archive->allocator;
+
+   size_t count;
+   struct xi_data *data = array_get(&archive->data, &count);
+   for (size_t i = 0; i < count; ++i)
+      data_free(&allocator, &data[i]);
+
+   array_release(&archive->data, &allocator);
+   array_release(&archive->compact, &allocator);
+   xi_free(&allocator, archive->spells.levels);
+   xi_free(&allocator, archive->spells.learned);
+   xi_free(&allocator, archive->spells.elements.values);
+   xi_free(&allocator, archive->spells.elements.bits);
+   xi_free(&allocator, archive->spells.skills.values);
+   xi_free(&allocator, archive->spells.skills.bits);
+   xi_free(&allocator, archive->strings.data);
+   xi_free(&allocator, archive);
+}
+
+/**
+ * Bounds checked view of the .dat data.
+ * Records are checked once with reader_record, fields are then loaded without checks.
+ * Data is never modified, encrypted fields are decoded as they are loaded.
+ */
+struct reader {
+   const uint8_t *data;
+   size_t size;
+   int rotation; // fixed encryption of the data, 0 == none
+};
+
+static inline uint8_t
+load_u8(const uint8_t *p, const int rot)
+{
+   return rotate_right(p[0], rot);
+}
+
+static inline uint16_t
+load_u16(const uint8_t *p, const int rot)
+{
+   return rotate_bytes_right(p[0] | (p[1] << 8), rot);
+}
+
+static inline uint32_t
+load_u32(const uint8_t *p, const int rot)
+{
+   return rotate_bytes_right(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24), rot);
+}
+
+/**
+ * Generates read_<name>(p, rot, out) and <name>_size() from record schema, see schema.h.
+ * Fields are read with straight line loads, size is the extent of the record in bytes.
+ * Records are zeroed first, padding is copied as is into store images.
+ */
+#define XI_READ_U8(field, offset) out->field = load_u8(p + (offset), rot);
+#define XI_READ_U16(field, offset) out->field = load_u16(p + (offset), rot);
+#define XI_READ_U32(field, offset) out->field = load_u32(p + (offset), rot);
+#define XI_READ_BYTES(field, offset) decode_copy(out->field, p + (offset), sizeof(out->field), rot);
+#define XI_READ_U8_ARRAY(field, offset) XI_READ_BYTES(field, offset)
+#define XI_READ_FIELD(kind, field, offset) XI_READ_##kind(field, offset)
+#define XI_FIELD_END(kind, field, offset) end = MAX(end, (size_t)(offset) + sizeof(out->field));
+
+#define XI_DEFINE_RECORD(name, type, schema) \
+   static inline void \
+   read_##name(const uint8_t *p, const int rot, type *out) \
+   { \
+      assert(p && out); \
+      memset(out, 0, sizeof(*out)); \
+      schema(XI_READ_FIELD) \
+   } \
+   \
+   static inline size_t \
+   name##_size(void) \
+   { \
+      const type *out = NULL; \
+      size_t end = 0; \
+      schema(XI_FIELD_END) \
+      (void)out; \
+      return end; \
    }
 
-   free(archive);
+XI_DEFINE_RECORD(name_id, struct xi_name_id, XI_SCHEMA_NAME_ID)
+XI_DEFINE_RECORD(ability, struct xi_ability, XI_SCHEMA_ABILITY)
+XI_DEFINE_RECORD(spell, struct xi_spell, XI_SCHEMA_SPELL)
+XI_DEFINE_RECORD(item, struct xi_item, XI_SCHEMA_ITEM)
+XI_DEFINE_RECORD(weapon, struct xi_item_weapon, XI_SCHEMA_ITEM_WEAPON)
+XI_DEFINE_RECORD(armor, struct xi_item_armor, XI_SCHEMA_ITEM_ARMOR)
+XI_DEFINE_RECORD(puppet, struct xi_item_puppet, XI_SCHEMA_ITEM_PUPPET)
+XI_DEFINE_RECORD(general, struct xi_item_general, XI_SCHEMA_ITEM_GENERAL)
+XI_DEFINE_RECORD(usable, struct xi_item_usable, XI_SCHEMA_ITEM_USABLE)
+
+enum xi_item_payload
+xi_item_payload_type(const uint16_t type, const uint16_t flags)
+{
+   if (type == XI_ITEM_TYPE_WEAPON)
+      return XI_ITEM_PAYLOAD_WEAPON;
+   else if (type == XI_ITEM_TYPE_ARMOR)
+      return XI_ITEM_PAYLOAD_ARMOR;
+   else if (type == XI_ITEM_TYPE_PUPPET)
+      return XI_ITEM_PAYLOAD_PUPPET;
+   else if (type == XI_ITEM_TYPE_FURNISHING || type == XI_ITEM_TYPE_MANNEQUIN || type == XI_ITEM_TYPE_FLOWERPOT)
+      return XI_ITEM_PAYLOAD_GENERAL;
+   else if (flags & XI_ITEM_USABLE)
+      return XI_ITEM_PAYLOAD_USABLE;
+
+   return XI_ITEM_PAYLOAD_NONE;
 }
 
-static void
-read_string(chckBuffer *buf, char out_bytes[1024], size_t *out_length)
+static const uint8_t*
+reader_record(const struct reader *r, const size_t offset, const size_t size)
 {
-   assert(buf && out_bytes && out_length);
+   assert(r);
 
-   *out_length = 0;
-   size_t max_size = chckBufferGetSize(buf) - chckBufferGetOffset(buf);
-   max_size = MIN(max_size, 1024);
+   if (offset > r->size || size > r->size - offset)
+      return NULL;
+
+   return r->data + offset;
+}
+
+static size_t
+read_string(const uint8_t *data, const size_t size)
+{
+   assert(data);
 
    // 1024 bytes should be enough to hold all the strings
    // strings are aligned by 4 bytes
-   for (size_t p = 0; p + 4 <= max_size && chckBufferRead(out_bytes + p, 1, 4, buf) == 4; p += 4) {
-      // check for \0 terminator, and increase lenght until then.
-      for (char *b = out_bytes + p; b - (out_bytes + p) < 4; ++b) {
-         if (*b == 0)
-            return;
-
-         *out_length += 1;
-      }
-   }
+   const size_t max_size = MIN(size, 1024) & ~(size_t)3;
+   const uint8_t *end = memchr(data, 0, max_size);
+   return (end ? (size_t)(end - data) : max_size);
 }
 
-static struct xi_string*
-read_strings(chckBuffer *buf, uint32_t *out_num_strings)
+static bool
+read_strings(const uint8_t *data, const size_t size, const int rot, const struct xi_allocator *allocator, const struct xi_load_options *options, const uint32_t max_strings, struct xi_string **out_strings, uint32_t *out_num_strings)
 {
-   assert(buf && out_num_strings);
+   assert(data && allocator && options && out_strings && out_num_strings);
 
+   *out_strings = NULL;
    *out_num_strings = 0;
 
-   size_t offset = chckBufferGetOffset(buf);
-   struct xi_string *strings = NULL;
-   uint32_t *offsets = NULL;
+   if (size < sizeof(uint32_t))
+      return false;
 
-   uint32_t num_strings;
-   chckBufferReadUInt32(buf, &num_strings);
+   // uint32_t count, { uint32_t offset, uint32_t flags }[count]
+   uint32_t num_strings = load_u32(data, rot);
+   if (num_strings > (size - sizeof(uint32_t)) / (sizeof(uint32_t) * 2))
+      return false;
 
-   if (!(offsets = calloc(num_strings, sizeof(uint32_t))))
-      goto fail;
+   num_strings = MIN(num_strings, max_strings);
 
-   if (!(strings = calloc(num_strings, sizeof(struct xi_string))))
-      goto fail;
+   struct xi_string *strings;
+   if (!(strings = xi_calloc(allocator, num_strings, sizeof(struct xi_string))))
+      return (num_strings == 0);
 
    for (uint32_t i = 0; i < num_strings; ++i) {
-      chckBufferReadUInt32(buf, &offsets[i]);
-      chckBufferReadUInt32(buf, &strings[i].flags);
-   }
-
-   for (uint32_t i = 0; i < num_strings; ++i) {
-      chckBufferSeek(buf, offset + offsets[i], SEEK_SET);
+      const uint32_t offset = load_u32(data + 4 + i * 8, rot);
+      strings[i].flags = load_u32(data + 4 + i * 8 + 4, rot);
 
-      uint32_t indicator;
-      chckBufferReadUInt32(buf, &indicator);
+      // uint32_t indicator, uint32_t padding[6] (0), char string[]
+      if (offset > size || size - offset < sizeof(uint32_t) * 7)
+         goto fail;
 
-      if (indicator != 1)
+      if (load_u32(data + offset, rot) != 1)
          continue;
 
-      // uint32_t padding[6] (0)
-      chckBufferSeek(buf, sizeof(uint32_t) * 6, SEEK_CUR);
-
+      // \0 stays \0 when rotated, so length can be found before decoding
       char bytes[1024];
-      read_string(buf, bytes, &strings[i].length);
-
-      if (!(strings[i].data = calloc(1, strings[i].length + 1)))
-         continue;
-
-      memcpy(strings[i].data, bytes, strings[i].length);
+      const uint8_t *string = data + offset + sizeof(uint32_t) * 7;
+      const size_t length = read_string(string, size - offset - sizeof(uint32_t) * 7);
+      decode_copy(bytes, string, length, rot);
+      if (!(strings[i].data = text_dup(allocator, options, bytes, length, &strings[i].length)))
+         goto fail;
    }
 
-   free(offsets);
+   *out_strings = strings;
    *out_num_strings = num_strings;
-   return strings;
+   return true;
 
 fail:
-   if (offsets)
-      free(offsets);
-   if (strings) {
-      for (uint32_t i = 0; i < num_strings; ++i)
-         free(strings[i].data);
-      free(strings);
-   }
-   return NULL;
+   for (uint32_t i = 0; i < num_strings; ++i)
+      xi_free(allocator, strings[i].data);
+   xi_free(allocator, strings);
+   return false;
 }
 
 static bool
-detect_name_id(chckBuffer *buf)
+detect_name_id(const struct reader *r)
 {
-   return (chckBufferGetSize(buf) >= 32 && !memcmp(chckBufferGetPointer(buf), "none\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 32));
+   const uint8_t *p = reader_record(r, 0, 32);
+   return (p && !memcmp(p, "none\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 32));
 }
 
-static void
-parse_name_id(struct xi_archive *archive, chckBuffer *buf)
+static bool
+parse_name_id(struct xi_archive *archive, const struct reader *r)
 {
-   assert(archive && buf);
+   assert(archive && r);
 
+   const uint8_t *p;
    struct xi_name_id name_id;
-   while (chckBufferRead(&name_id.name, 1, sizeof(name_id.name), buf) == sizeof(name_id.name) && chckBufferReadUInt32(buf, &name_id.id))
-      archive_add_data(archive, XI_TYPE_NAME_ID, &name_id);
+   for (size_t offset = 0; (p = reader_record(r, offset, name_id_size())); offset += name_id_size()) {
+      read_name_id(p, 0, &name_id);
+      if (!archive_add_data(archive, XI_TYPE_NAME_ID, &name_id))
+         return false;
+   }
+
+   return true;
 }
 
 static bool
-detect_ability(chckBuffer *buf)
+detect_ability(const struct reader *r)
 {
-   struct xi_ability ability;
-
-   if (chckBufferGetSize(buf) < 0x400)
+   const uint8_t *p;
+   if (!(p = reader_record(r, 0, 0x400)))
       return false;
 
-   memcpy(&ability, chckBufferGetPointer(buf), sizeof(ability));
-   decode((uint8_t*)&ability, sizeof(ability), rotation_for_variable_encryption((uint8_t*)&ability, sizeof(ability)));
+   struct xi_ability ability;
+   read_ability(p, rotation_for_variable_encryption(p, 0x400), &ability);
    return (ability.index == 0 && ability.icon_id == 11776 && ability.mp_cost == 0 && ability.targets == 1 && ability.name[0] == '.' && ability.description[0] == '.');
 }
 
-static void
-parse_ability(struct xi_archive *archive, chckBuffer *buf)
+static bool
+parse_ability(struct xi_archive *archive, const struct reader *r)
 {
-   assert(archive && buf);
-
-   uint8_t *data = (uint8_t*)chckBufferGetOffsetPointer(buf);
-   decode(data, 0x400, rotation_for_variable_encryption(data, 0x400));
+   assert(archive && r);
 
+   const uint8_t *p;
    struct xi_ability ability;
-   while (chckBufferReadUInt16(buf, &ability.index) &&
-          chckBufferReadUInt16(buf, &ability.icon_id) &&
-          chckBufferReadUInt16(buf, &ability.mp_cost) &&
-          chckBufferReadUInt16(buf, &ability.unknown) &&
-          chckBufferReadUInt16(buf, &ability.targets) &&
-          chckBufferRead(ability.name, 1, sizeof(ability.name), buf) == sizeof(ability.name) &&
-          chckBufferRead(ability.description, 1, sizeof(ability.description), buf) == sizeof(ability.description)) {
-      archive_add_data(archive, XI_TYPE_ABILITY, &ability);
-      chckBufferSeek(buf, 0x2D6, SEEK_CUR);
+   for (size_t offset = 0; (p = reader_record(r, offset, 0x400)); offset += 0x400) {
+      read_ability(p, rotation_for_variable_encryption(p, 0x400), &ability);
+      if (!archive_add_ability(archive, &ability))
+         return false;
+   }
 
-      if (chckBufferGetOffset(buf) + 0x400 >= chckBufferGetSize(buf))
-         break;
+   return true;
+}
 
-      data = (uint8_t*)chckBufferGetOffsetPointer(buf);
-      decode(data, 0x400, rotation_for_variable_encryption(data, 0x400));
-   }
+static bool
+detect_spell(const struct reader *r)
+{
+   const uint8_t *p;
+   if (!(p = reader_record(r, 0, 0x400)))
+      return false;
+
+   struct xi_spell spell;
+   read_spell(p, rotation_for_variable_encryption(p, 0x400), &spell);
+   return (spell.index == 0 && spell.type == 0 && spell.element == 6 && spell.targets == 63 && spell.skill == 32 && spell.mp_cost == 0);
 }
 
 static bool
-detect_spell(chckBuffer *buf)
+parse_spell(struct xi_archive *archive, const struct reader *r)
 {
+   assert(archive && r);
+
+   const uint8_t *p;
    struct xi_spell spell;
+   for (size_t offset = 0; (p = reader_record(r, offset, 0x400)); offset += 0x400) {
+      read_spell(p, rotation_for_variable_encryption(p, 0x400), &spell);
+      if (!archive_add_spell(archive, &spell))
+         return false;
+   }
 
-   if (chckBufferGetSize(buf) < 0x400)
+   return true;
+}
+
+static bool
+detect_item(const struct reader *r)
+{
+   const uint8_t *p;
+   if (!(p = reader_record(r, 0, item_size())))
       return false;
 
-   memcpy(&spell, chckBufferGetPointer(buf), sizeof(spell));
-   decode((uint8_t*)&spell, sizeof(spell), rotation_for_variable_encryption((uint8_t*)&spell, sizeof(spell)));
-   return (spell.index == 0 && spell.type == 0 && spell.element == 6 && spell.targets == 63 && spell.skill == 32 && spell.mp_cost == 0);
+   struct xi_item item;
+   read_item(p, 5, &item);
+   return (item.id > 0 && item.type != XI_ITEM_TYPE_NONE);
 }
 
-static void
-parse_spell(struct xi_archive *archive, chckBuffer *buf)
+static size_t
+item_payload_size(const struct xi_item *item)
 {
-   assert(archive && buf);
+   assert(item);
+
+   // size as stored in the .dat, not sizeof the struct
+   switch (xi_item_payload_type(item->type, item->flags)) {
+      case XI_ITEM_PAYLOAD_WEAPON: return weapon_size();
+      case XI_ITEM_PAYLOAD_ARMOR: return armor_size();
+      case XI_ITEM_PAYLOAD_PUPPET: return puppet_size();
+      case XI_ITEM_PAYLOAD_GENERAL: return general_size();
+      case XI_ITEM_PAYLOAD_USABLE: return usable_size();
+      default:break;
+   }
 
-   uint8_t *data = (uint8_t*)chckBufferGetOffsetPointer(buf);
-   decode(data, 0x400, rotation_for_variable_encryption(data, 0x400));
+   return 0;
+}
 
-   struct xi_spell spell;
-   while (chckBufferReadUInt16(buf, &spell.index) &&
-          chckBufferReadUInt16(buf, &spell.type) &&
-          chckBufferReadUInt16(buf, &spell.element) &&
-          chckBufferReadUInt16(buf, &spell.targets) &&
-          chckBufferReadUInt16(buf, &spell.skill) &&
-          chckBufferReadUInt16(buf, &spell.mp_cost) &&
-          chckBufferReadUInt8(buf, &spell.casting_time) &&
-          chckBufferReadUInt8(buf, &spell.recast_delay) &&
-          chckBufferRead(spell.level, 1, sizeof(spell.level), buf) == sizeof(spell.level) &&
-          chckBufferReadUInt16(buf, &spell.id) &&
-          chckBufferReadUInt8(buf, &spell.unknown) &&
-          chckBufferRead(spell.jp_name, 1, sizeof(spell.jp_name), buf) == sizeof(spell.jp_name) &&
-          chckBufferRead(spell.en_name, 1, sizeof(spell.en_name), buf) == sizeof(spell.en_name) &&
-          chckBufferRead(spell.jp_description, 1, sizeof(spell.jp_description), buf) == sizeof(spell.jp_description) &&
-          chckBufferRead(spell.en_description, 1, sizeof(spell.en_description), buf) == sizeof(spell.en_description)) {
-      archive_add_data(archive, XI_TYPE_SPELL, &spell);
-      chckBufferSeek(buf, 0x2AF, SEEK_CUR);
-
-      if (chckBufferGetOffset(buf) + 0x400 >= chckBufferGetSize(buf))
-         break;
-
-      data = (uint8_t*)chckBufferGetOffsetPointer(buf);
-      decode(data, 0x400, rotation_for_variable_encryption(data, 0x400));
+static int
+read_item_payload(const struct xi_allocator *allocator, const uint8_t *p, const int rot, struct xi_item *item)
+{
+   assert(allocator && p && item);
+
+   switch (xi_item_payload_type(item->type, item->flags)) {
+      case XI_ITEM_PAYLOAD_WEAPON: {
+            struct xi_item_weapon weapon;
+            read_weapon(p, rot, &weapon);
+            return item_set_data(allocator, item, sizeof(weapon), &weapon);
+         }
+      case XI_ITEM_PAYLOAD_ARMOR: {
+            struct xi_item_armor armor;
+            read_armor(p, rot, &armor);
+            return item_set_data(allocator, item, sizeof(armor), &armor);
+         }
+      case XI_ITEM_PAYLOAD_PUPPET: {
+            struct xi_item_puppet puppet;
+            read_puppet(p, rot, &puppet);
+            return item_set_data(allocator, item, sizeof(puppet), &puppet);
+         }
+      case XI_ITEM_PAYLOAD_GENERAL: {
+            struct xi_item_general general;
+            read_general(p, rot, &general);
+            return item_set_data(allocator, item, sizeof(general), &general);
+         }
+      case XI_ITEM_PAYLOAD_USABLE: {
+            struct xi_item_usable usable;
+            read_usable(p, rot, &usable);
+            return item_set_data(allocator, item, sizeof(usable), &usable);
+         }
+      default:break;
    }
+
+   return 1;
 }
 
 static bool
-detect_item(chckBuffer *buf)
+parse_item(struct xi_archive *archive, const struct reader *r)
 {
+   assert(archive && r);
+
+   const uint32_t fields = (archive->options.item_fields ? archive->options.item_fields : XI_ITEM_FIELDS_ALL);
+   const uint32_t max_strings = (fields & XI_ITEM_FIELDS_STRINGS ? UINT32_MAX : (fields & XI_ITEM_FIELDS_NAME ? 1 : 0));
+
+   const int rot = r->rotation;
+
+   const size_t header_size = item_size();
+
    struct xi_item item;
+   for (size_t offset = 0; offset + header_size <= r->size; offset += 0xC00) {
+      // last record may be cut short
+      const size_t size = MIN(r->size - offset, 0xC00);
+      const uint8_t *p = reader_record(r, offset, size);
+
+      memset(&item, 0, sizeof(item));
+      read_item(p, rot, &item);
+
+      if (item.id == 0 || item.type == XI_ITEM_TYPE_NONE)
+         return false;
+
+      const size_t payload_size = item_payload_size(&item);
+      if (header_size + payload_size > size)
+         return false;
+
+      if ((fields & XI_ITEM_FIELDS_PAYLOAD) && !read_item_payload(&archive->allocator, p + header_size, rot, &item))
+         goto fail;
+
+      if (max_strings > 0 && !read_strings(p + header_size + payload_size, size - header_size - payload_size, rot, &archive->allocator, &archive->options, max_strings, &item.strings, &item.num_strings))
+         goto fail;
+
+      if (!archive_add_data(archive, XI_TYPE_ITEM, &item))
+         goto fail;
+   }
+
+   return true;
+
+fail:
+   item_release(&archive->allocator, &item);
+   return false;
+}
+
+struct parse_job {
+   struct xi_archive *archive;
+   bool (*parse)(struct xi_archive *archive, const struct reader *r);
+   struct reader reader;
+   pthread_t thread;
+   bool started, ret;
+};
+
+static void*
+parse_job_run(void *arg)
+{
+   struct parse_job *job = arg;
+   assert(job);
+
+   job->ret = job->parse(job->archive, &job->reader);
+   return NULL;
+}
 
-   if (chckBufferGetSize(buf) < sizeof(item))
+static unsigned int
+parse_thread_count(const struct xi_load_options *options)
+{
+   assert(options);
+
+   if (options->threads > 0)
+      return options->threads;
+
+   const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   return (cpus > 0 ? cpus : 1);
+}
+
+static int
+archive_take_data(struct xi_archive *archive, struct xi_archive *from)
+{
+   assert(archive && from);
+
+   size_t count;
+   int ret = 1;
+   struct xi_data *list = array_get(&from->data, &count);
+   for (size_t i = 0; i < count; ++i) {
+      if (ret && array_add(&archive->data, &archive->allocator, &list[i]))
+         continue;
+
+      data_free(&from->allocator, &list[i]);
+      ret = 0;
+   }
+
+   array_release(&from->data, &from->allocator);
+   return ret;
+}
+
+static int
+parse_parallel(struct xi_archive *archive, bool (*parse)(struct xi_archive *archive, const struct reader *r), const struct reader *r, const size_t record_size)
+{
+   assert(archive && parse && r && record_size > 0);
+
+   // records are independent, so each thread decodes and parses its own range
+   // and the results are appended to archive in the original order
+   const size_t records = (r->size + record_size - 1) / record_size;
+   const unsigned int threads = MIN(parse_thread_count(&archive->options), records);
+
+   struct parse_job *jobs;
+   if (!(jobs = xi_calloc(&archive->allocator, threads, sizeof(struct parse_job))))
+      return 0;
+
+   int ret = 1;
+   for (unsigned int t = 0; t < threads; ++t) {
+      const size_t first = records * t / threads, last = records * (t + 1) / threads;
+      jobs[t].parse = parse;
+      jobs[t].reader.data = r->data + first * record_size;
+      jobs[t].reader.size = MIN(last * record_size, r->size) - first * record_size;
+      jobs[t].reader.rotation = r->rotation;
+
+      if (!(jobs[t].archive = xi_archive_new_with_allocator(&archive->allocator)))
+         ret = 0;
+      else
+         jobs[t].archive->options = archive->options;
+   }
+
+   if (ret) {
+      for (unsigned int t = 1; t < threads; ++t)
+         jobs[t].started = !pthread_create(&jobs[t].thread, NULL, parse_job_run, &jobs[t]);
+
+      for (unsigned int t = 0; t < threads; ++t) {
+         if (jobs[t].started) {
+            pthread_join(jobs[t].thread, NULL);
+         } else {
+            parse_job_run(&jobs[t]);
+         }
+      }
+   }
+
+   for (unsigned int t = 0; t < threads; ++t) {
+      if (!jobs[t].archive)
+         continue;
+
+      if (ret && (!jobs[t].ret || !archive_take_data(archive, jobs[t].archive)))
+         ret = 0;
+
+      xi_archive_free(jobs[t].archive);
+   }
+
+   xi_free(&archive->allocator, jobs);
+   return ret;
+}
+
+static int
+spell_entry_compare(const void *a, const void *b)
+{
+   const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+   return (x > y) - (x < y);
+}
+
+static int
+spell_value_compare(const void *a, const void *b)
+{
+   const uint16_t x = *(const uint16_t*)a, y = *(const uint16_t*)b;
+   return (x > y) - (x < y);
+}
+
+static bool
+spell_values_build(const struct xi_allocator *allocator, const size_t words, uint16_t *values, const size_t count, struct xi_spell_values *out)
+{
+   assert(allocator && values && count > 0 && out);
+
+   if (!(out->values = xi_alloc(allocator, count * sizeof(uint16_t))))
       return false;
 
-   memcpy(&item, chckBufferGetPointer(buf), sizeof(item));
-   decode((uint8_t*)&item, sizeof(item), 5);
-   return (item.id > 0 && item.type != XI_ITEM_TYPE_NONE);
+   memcpy(out->values, values, count * sizeof(uint16_t));
+   qsort(out->values, count, sizeof(uint16_t), spell_value_compare);
+
+   out->count = 1;
+   for (size_t i = 1; i < count; ++i) {
+      if (out->values[i] != out->values[out->count - 1])
+         out->values[out->count++] = out->values[i];
+   }
+
+   if (!(out->bits = xi_calloc(allocator, out->count * words, sizeof(uint64_t))))
+      return false;
+
+   for (size_t i = 0; i < count; ++i) {
+      const uint16_t *value = bsearch(&values[i], out->values, out->count, sizeof(uint16_t), spell_value_compare);
+      out->bits[(value - out->values) * words + i / 64] |= (uint64_t)1 << (i % 64);
+   }
+
+   return true;
 }
 
-static void
-parse_item(struct xi_archive *archive, chckBuffer *buf)
+static bool
+spell_index_build(struct xi_archive *archive)
 {
-   assert(archive && buf);
+   assert(archive);
 
-   struct xi_item item;
-   memset(&item, 0, sizeof(item));
-
-   while (chckBufferReadUInt32(buf, &item.id) &&
-          chckBufferReadUInt16(buf, &item.flags) &&
-          chckBufferReadUInt16(buf, &item.stack) &&
-          chckBufferReadUInt16(buf, &item.type) &&
-          chckBufferReadUInt16(buf, &item.resource) &&
-          chckBufferReadUInt16(buf, &item.targets)) {
-      assert(item.id > 0 && item.type != XI_ITEM_TYPE_NONE);
-      size_t next = chckBufferGetOffset(buf) + 0x202 + 0xA00 - 16;
-
-      if (item.type == XI_ITEM_TYPE_WEAPON) {
-         struct xi_item_weapon weapon;
-         chckBufferReadUInt16(buf, &weapon.level);
-         chckBufferReadUInt16(buf, &weapon.slots);
-         chckBufferReadUInt16(buf, &weapon.races);
-         chckBufferReadUInt32(buf, &weapon.jobs);
-         chckBufferReadUInt16(buf, &weapon.damage);
-         chckBufferReadUInt16(buf, &weapon.delay);
-         chckBufferReadUInt16(buf, &weapon.dps);
-         chckBufferReadUInt8(buf, &weapon.skill);
-         chckBufferReadUInt8(buf, &weapon.jug_size);
-         chckBufferReadUInt32(buf, &weapon.unknown);
-         chckBufferReadUInt8(buf, &weapon.max_charges);
-         chckBufferReadUInt8(buf, &weapon.casting_time);
-         chckBufferReadUInt16(buf, &weapon.use_delay);
-         chckBufferReadUInt32(buf, &weapon.reuse_delay);
-         chckBufferReadUInt32(buf, &weapon.unknown2);
-         item_set_data(&item, sizeof(weapon), &weapon);
-      } else if (item.type == XI_ITEM_TYPE_ARMOR) {
-         struct xi_item_armor armor;
-         chckBufferReadUInt16(buf, &armor.level);
-         chckBufferReadUInt16(buf, &armor.slots);
-         chckBufferReadUInt16(buf, &armor.races);
-         chckBufferReadUInt32(buf, &armor.jobs);
-         chckBufferReadUInt16(buf, &armor.shield_size);
-         chckBufferReadUInt8(buf, &armor.max_charges);
-         chckBufferReadUInt8(buf, &armor.casting_time);
-         chckBufferReadUInt16(buf, &armor.use_delay);
-         chckBufferReadUInt16(buf, &armor.unknown);
-         chckBufferReadUInt32(buf, &armor.reuse_delay);
-         chckBufferReadUInt32(buf, &armor.unknown2);
-         item_set_data(&item, sizeof(armor), &armor);
-      } else if (item.type == XI_ITEM_TYPE_PUPPET) {
-         struct xi_item_puppet puppet;
-         chckBufferReadUInt16(buf, &puppet.slot);
-         chckBufferReadUInt32(buf, &puppet.element_charge);
-         chckBufferReadUInt32(buf, &puppet.unknown);
-         item_set_data(&item, sizeof(puppet), &puppet);
-      } else if (item.type == XI_ITEM_TYPE_FURNISHING || item.type == XI_ITEM_TYPE_MANNEQUIN || item.type == XI_ITEM_TYPE_FLOWERPOT) {
-         struct xi_item_general general;
-         chckBufferReadUInt16(buf, &general.element);
-         chckBufferReadUInt32(buf, &general.storage_slots);
-         item_set_data(&item, sizeof(general), &general);
-      } else if (item.flags & XI_ITEM_USABLE) {
-         struct xi_item_usable usable;
-         chckBufferReadUInt16(buf, &usable.activation_time);
-         chckBufferReadUInt32(buf, &usable.unknown);
-         chckBufferReadUInt32(buf, &usable.unknown2);
-         item_set_data(&item, sizeof(usable), &usable);
+   size_t count;
+   const struct xi_data *data = NULL;
+   const struct xi_spell_compact *compact = NULL;
+   if (archive->options.flags & XI_LOAD_COMPACT) {
+      compact = xi_archive_get_compact_spell_list(archive, &count);
+   } else {
+      data = xi_archive_get_data_list(archive, &count);
+   }
+
+   struct xi_spell_index *index = &archive->spells;
+   if (!count || count >= (1 << 24))
+      return (count == 0);
+
+   bool ret = false;
+   uint32_t *entries = NULL;
+   uint16_t *values = NULL;
+   const size_t words = (count + 63) / 64;
+
+   // (level, spell) sorted per job, only needed to build the bitsets
+   size_t offsets[XI_SPELL_JOBS + 1] = {0};
+   for (size_t i = 0; i < count; ++i) {
+      const uint8_t *level = (compact ? compact[i].level : data[i].spell->level);
+      for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j)
+         offsets[j + 1] += (level[j] != 0xFF);
+   }
+
+   for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j)
+      offsets[j + 1] += offsets[j];
+
+   if (offsets[XI_SPELL_JOBS] > 0 && !(entries = xi_alloc(&archive->allocator, offsets[XI_SPELL_JOBS] * sizeof(uint32_t))))
+      goto out;
+
+   size_t cursor[XI_SPELL_JOBS];
+   memcpy(cursor, offsets, sizeof(cursor));
+
+   for (size_t i = 0; i < count; ++i) {
+      const uint8_t *level = (compact ? compact[i].level : data[i].spell->level);
+      for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j) {
+         if (level[j] != 0xFF)
+            entries[cursor[j]++] = ((uint32_t)level[j] << 24) | i;
       }
+   }
 
-      item.strings = read_strings(buf, &item.num_strings);
-      archive_add_data(archive, XI_TYPE_ITEM, &item);
-      memset(&item, 0, sizeof(item));
+   for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j) {
+      qsort(entries + offsets[j], offsets[j + 1] - offsets[j], sizeof(uint32_t), spell_entry_compare);
+
+      for (size_t e = offsets[j]; e < offsets[j + 1]; ++e)
+         index->level_offsets[j + 1] += (e == offsets[j] || (entries[e] >> 24) != (entries[e - 1] >> 24));
+   }
+
+   for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j)
+      index->level_offsets[j + 1] += index->level_offsets[j];
+
+   const size_t rows = index->level_offsets[XI_SPELL_JOBS];
+   if (rows > 0 &&
+       (!(index->levels = xi_alloc(&archive->allocator, rows)) ||
+        !(index->learned = xi_calloc(&archive->allocator, rows * words, sizeof(uint64_t)))))
+      goto out;
+
+   // every row has the bits of the job's lower levels as well
+   for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j) {
+      size_t row = index->level_offsets[j];
+      for (size_t e = offsets[j]; e < offsets[j + 1]; ++e) {
+         if (e > offsets[j] && (entries[e] >> 24) != (entries[e - 1] >> 24)) {
+            memcpy(index->learned + (row + 1) * words, index->learned + row * words, words * sizeof(uint64_t));
+            ++row;
+         }
+
+         const uint32_t spell = entries[e] & 0xFFFFFF;
+         index->levels[row] = entries[e] >> 24;
+         index->learned[row * words + spell / 64] |= (uint64_t)1 << (spell % 64);
+      }
+   }
+
+   if (!(values = xi_alloc(&archive->allocator, count * sizeof(uint16_t))))
+      goto out;
+
+   for (size_t i = 0; i < count; ++i)
+      values[i] = (compact ? compact[i].element : data[i].spell->element);
+
+   if (!spell_values_build(&archive->allocator, words, values, count, &index->elements))
+      goto out;
+
+   for (size_t i = 0; i < count; ++i)
+      values[i] = (compact ? compact[i].skill : data[i].spell->skill);
+
+   if (!spell_values_build(&archive->allocator, words, values, count, &index->skills))
+      goto out;
+
+   index->count = count;
+   index->words = words;
+   ret = true;
+
+out:
+   xi_free(&archive->allocator, entries);
+   xi_free(&archive->allocator, values);
+   return ret;
+}
+
+static const struct {
+   const char *name;
+   bool (*detect)(const struct reader *r);
+   bool (*parse)(struct xi_archive *archive, const struct reader *r);
+   int fixed_encryption; // 0 == none, > 0 number of bits to rotate right
+   size_t record_size; // 0 == variable, > 0 records can be parsed in parallel
+} loaders[XI_TYPE_UNKNOWN] = {
+   { // XI_TYPE_NAME_ID
+      .name = "name-id",
+      .detect = detect_name_id,
+      .parse = parse_name_id,
+      .fixed_encryption = 0,
+   },
+   { // XI_TYPE_ABILITY
+      .name = "ability",
+      .detect = detect_ability,
+      .parse = parse_ability,
+      .fixed_encryption = 0, // has variable encryption
+   },
+   { // XI_TYPE_SPELL
+      .name = "spell",
+      .detect = detect_spell,
+      .parse = parse_spell,
+      .fixed_encryption = 0, // has variable encryption
+   },
+   { // XI_TYPE_ITEM
+      .name = "item",
+      .detect = detect_item,
+      .parse = parse_item,
+      .fixed_encryption = 5,
+      .record_size = 0xC00,
+   },
+};
+
+// detectors look at most at the first record of this size
+#define XI_DETECT_SIZE 0x400
+
+static enum xi_data_type
+detect_type(const struct reader *r)
+{
+   assert(r);
+
+   for (unsigned int i = 0; i < XI_TYPE_UNKNOWN; ++i) {
+      if (loaders[i].detect(r))
+         return i;
+   }
+
+   return XI_TYPE_UNKNOWN;
+}
+
+enum xi_data_type
+xi_archive_detect_memory(const void *data, const size_t size)
+{
+   assert(data || !size);
+
+   const struct reader r = { .data = data, .size = MIN(size, XI_DETECT_SIZE) };
+   return detect_type(&r);
+}
+
+enum xi_data_type
+xi_archive_detect_file(const char *file)
+{
+   assert(file);
+
+   int fd;
+   if ((fd = open(file, O_RDONLY)) == -1)
+      return XI_TYPE_UNKNOWN;
 
-      chckBufferSeek(buf, next, SEEK_SET);
+   ssize_t ret;
+   size_t size = 0;
+   uint8_t data[XI_DETECT_SIZE];
+   while (size < sizeof(data) && ((ret = pread(fd, data + size, sizeof(data) - size, size)) > 0 || (ret == -1 && errno == EINTR)))
+      size += (ret > 0 ? (size_t)ret : 0);
+
+   close(fd);
+   return xi_archive_detect_memory(data, size);
+}
+
+const char*
+xi_data_type_to_string(const enum xi_data_type type)
+{
+   return (type < XI_TYPE_UNKNOWN ? loaders[type].name : "unknown");
+}
+
+enum xi_data_type
+xi_data_type_from_string(const char *string)
+{
+   assert(string);
+
+   for (unsigned int i = 0; i < XI_TYPE_UNKNOWN; ++i) {
+      if (!strcmp(loaders[i].name, string))
+         return i;
    }
+
+   return XI_TYPE_UNKNOWN;
 }
 
 struct xi_archive*
-xi_archive_load_from_memory(const void *data, const size_t size)
+xi_archive_load_from_memory_with_options(const void *data, const size_t size, const struct xi_load_options *options)
 {
    assert(data && size);
 
    struct xi_archive *archive;
-   chckBuffer *buf = NULL;
 
-   if (!(archive = xi_archive_new()))
+   if (!(archive = xi_archive_new_with_allocator(options ? options->allocator : NULL)))
       goto fail;
 
-   if (!(buf = chckBufferNewFromPointer(data, size, CHCK_BUFFER_ENDIAN_LITTLE)))
-      goto fail;
+   if (options)
+      archive->options = *options;
 
-   struct header {
-      const char *data;
-      size_t size;
-   };
-
-   static struct {
-      bool (*detect)(chckBuffer *buf);
-      void (*parse)(struct xi_archive *archive, chckBuffer *buf);
-      int fixed_encryption; // 0 == none, > 0 number of bits to rotate right
-   } map[XI_TYPE_UNKNOWN] = {
-      { // XI_TYPE_NAME_ID
-         .detect = detect_name_id,
-         .parse = parse_name_id,
-         .fixed_encryption = 0,
-      },
-      { // XI_TYPE_ABILITY
-         .detect = detect_ability,
-         .parse = parse_ability,
-         .fixed_encryption = 0, // has variable encryption
-      },
-      { // XI_TYPE_SPELL
-         .detect = detect_spell,
-         .parse = parse_spell,
-         .fixed_encryption = 0, // has variable encryption
-      },
-      { // XI_TYPE_ITEM
-         .detect = detect_item,
-         .parse = parse_item,
-         .fixed_encryption = 5,
-      },
-   };
+   enum xi_data_type type;
+   struct reader r = { .data = data, .size = size };
 
-   bool found = false;
-   for (unsigned int i = 0; i < XI_TYPE_UNKNOWN; ++i) {
-      if (!map[i].detect(buf))
-         continue;
+   if (archive->options.flags & XI_LOAD_TYPE_HINT) {
+      type = MIN(archive->options.type, XI_TYPE_UNKNOWN);
+   } else {
+      type = detect_type(&r);
+   }
 
-      if (map[i].fixed_encryption > 0) {
-         decode((uint8_t*)data, size, map[i].fixed_encryption);
-#if 0
-         FILE *f = fopen("dec.dat", "wb");
-         fwrite(data, 1, size, f);
-         fclose(f);
-#endif
+   archive->type = type;
+   if (type < XI_TYPE_UNKNOWN) {
+      r.rotation = loaders[type].fixed_encryption;
+      if ((archive->options.flags & XI_LOAD_PARALLEL) && loaders[type].record_size > 0 && size >= loaders[type].record_size * 2) {
+         if (!parse_parallel(archive, loaders[type].parse, &r, loaders[type].record_size))
+            goto fail;
+      } else if (!loaders[type].parse(archive, &r)) {
+         goto fail;
       }
-
-      map[i].parse(archive, buf);
-      found = true;
-      break;
    }
 
-   if (!found)
+   if (type >= XI_TYPE_UNKNOWN)
       archive_add_data(archive, XI_TYPE_UNKNOWN, NULL);
 
-   chckBufferFree(buf);
+   if (type == XI_TYPE_SPELL && !spell_index_build(archive))
+      goto fail;
+
+   string_pool_shrink(&archive->strings, &archive->allocator);
    return archive;
 
 fail:
    if (archive)
       xi_archive_free(archive);
-   if (buf)
-      chckBufferFree(buf);
    return NULL;
 }
 
 struct xi_archive*
-xi_archive_load_from_file(const char *file)
+xi_archive_load_from_memory(const void *data, const size_t size)
+{
+   return xi_archive_load_from_memory_with_options(data, size, NULL);
+}
+
+struct xi_archive*
+xi_archive_load_from_file_with_options(const char *file, const struct xi_load_options *options)
 {
    assert(file);
 
+   const struct xi_allocator *allocator = (options && options->allocator ? options->allocator : &xi_default_allocator);
+
    void *data;
    size_t size;
-   if (!(data = data_from_file(file, &size)))
-      goto fail;
+   if (!(data = data_from_file(allocator, file, &size)))
+      return NULL;
 
-   struct xi_archive *archive = xi_archive_load_from_memory(data, size);
-   free(data);
+   struct xi_archive *archive = xi_archive_load_from_memory_with_options(data, size, options);
+   xi_free(allocator, data);
    return archive;
+}
 
-fail:
-   free(data);
-   return NULL;
+struct xi_archive*
+xi_archive_load_from_file(const char *file)
+{
+   return xi_archive_load_from_file_with_options(file, NULL);
+}
+
+size_t
+xi_item_payload_size(const uint16_t type, const uint16_t flags)
+{
+   switch (xi_item_payload_type(type, flags)) {
+      case XI_ITEM_PAYLOAD_WEAPON: return sizeof(struct xi_item_weapon);
+      case XI_ITEM_PAYLOAD_ARMOR: return sizeof(struct xi_item_armor);
+      case XI_ITEM_PAYLOAD_PUPPET: return sizeof(struct xi_item_puppet);
+      case XI_ITEM_PAYLOAD_GENERAL: return sizeof(struct xi_item_general);
+      case XI_ITEM_PAYLOAD_USABLE: return sizeof(struct xi_item_usable);
+      default:break;
+   }
+
+   return 0;
+}
+
+size_t
+xi_archive_get_memory_usage(struct xi_archive *archive)
+{
+   assert(archive);
+
+   size_t count, bytes = sizeof(struct xi_archive) + archive->strings.allocated;
+   const struct xi_data *data = xi_archive_get_data_list(archive, &count);
+   bytes += archive->data.allocated * archive->data.member;
+
+   for (size_t i = 0; i < count; ++i) {
+      if (data[i].type != XI_TYPE_ITEM) {
+         bytes += (data[i].type != XI_TYPE_UNKNOWN ? xi_data_sizes[data[i].type] : 0);
+         continue;
+      }
+
+      const struct xi_item *item = data[i].item;
+      bytes += sizeof(struct xi_item) + item->num_strings * sizeof(struct xi_string);
+      bytes += (item->any ? xi_item_payload_size(item->type, item->flags) : 0);
+
+      for (uint32_t s = 0; s < item->num_strings; ++s)
+         bytes += (item->strings[s].data ? item->strings[s].length + 1 : 0);
+   }
+
+   bytes += archive->compact.allocated * archive->compact.member;
+
+   const struct xi_spell_index *spells = &archive->spells;
+   const size_t rows = spells->level_offsets[XI_SPELL_JOBS];
+   bytes += rows * (1 + spells->words * sizeof(uint64_t));
+   bytes += (spells->elements.values ? spells->count * sizeof(uint16_t) + spells->elements.count * spells->words * sizeof(uint64_t) : 0);
+   bytes += (spells->skills.values ? spells->count * sizeof(uint16_t) + spells->skills.count * spells->words * sizeof(uint64_t) : 0);
+
+   return bytes;
+}
+
+enum xi_data_type
+xi_archive_get_type(const struct xi_archive *archive)
+{
+   assert(archive);
+   return archive->type;
+}
+
+const struct xi_allocator*
+xi_archive_get_allocator(const struct xi_archive *archive)
+{
+   assert(archive);
+   return &archive->allocator;
 }
 
 const struct xi_data*
 xi_archive_get_data_list(struct xi_archive *archive, size_t *out_count)
 {
    assert(archive);
-   return chckIterPoolToCArray(archive->data, out_count);
+   return array_get(&archive->data, out_count);
+}
+
+static const void*
+archive_get_compact_list(struct xi_archive *archive, const enum xi_data_type type, size_t *out_count)
+{
+   assert(archive);
+
+   if (!archive->compact.member || archive->compact_type != type) {
+      if (out_count)
+         *out_count = 0;
+      return NULL;
+   }
+
+   return array_get(&archive->compact, out_count);
+}
+
+const struct xi_ability_compact*
+xi_archive_get_compact_ability_list(struct xi_archive *archive, size_t *out_count)
+{
+   return archive_get_compact_list(archive, XI_TYPE_ABILITY, out_count);
+}
+
+const struct xi_spell_compact*
+xi_archive_get_compact_spell_list(struct xi_archive *archive, size_t *out_count)
+{
+   return archive_get_compact_list(archive, XI_TYPE_SPELL, out_count);
+}
+
+static unsigned int
+lowest_bit(const uint64_t bits)
+{
+   assert(bits);
+#if defined(__GNUC__)
+   return __builtin_ctzll(bits);
+#else
+   unsigned int bit = 0;
+   for (; !(bits & ((uint64_t)1 << bit)); ++bit);
+   return bit;
+#endif
+}
+
+static const uint64_t*
+spell_index_learned(const struct xi_spell_index *index, const unsigned int job, const uint8_t level)
+{
+   assert(index && job < XI_SPELL_JOBS);
+
+   // last row of the job at or below level
+   size_t lo = index->level_offsets[job], hi = index->level_offsets[job + 1];
+   while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (index->levels[mid] <= level) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+
+   return (lo > index->level_offsets[job] ? index->learned + (lo - 1) * index->words : NULL);
+}
+
+static const uint64_t*
+spell_index_values(const struct xi_spell_index *index, const struct xi_spell_values *values, const uint16_t value)
+{
+   assert(index && values);
+
+   const uint16_t *found;
+   if (!(found = bsearch(&value, values->values, values->count, sizeof(uint16_t), spell_value_compare)))
+      return NULL;
+
+   return values->bits + (found - values->values) * index->words;
+}
+
+size_t
+xi_archive_query_spells(const struct xi_archive *archive, const struct xi_spell_query *query, uint32_t *out_spells, const size_t max)
+{
+   assert(archive && query && (out_spells || !max));
+
+   const struct xi_spell_index *index = &archive->spells;
+   if (!index->learned || query->level_min > query->level_max)
+      return 0;
+
+   // learned at level_max and not yet at level_min - 1, per job
+   size_t rows = 0;
+   const uint64_t *upper[XI_SPELL_JOBS], *lower[XI_SPELL_JOBS];
+   for (unsigned int j = 0; j < XI_SPELL_JOBS; ++j) {
+      if (!(query->jobs & (1u << j)) || !(upper[rows] = spell_index_learned(index, j, query->level_max)))
+         continue;
+
+      lower[rows++] = (query->level_min > 0 ? spell_index_learned(index, j, query->level_min - 1) : NULL);
+   }
+
+   const uint64_t *element = NULL, *skill = NULL;
+   if ((query->flags & XI_SPELL_QUERY_ELEMENT) && !(element = spell_index_values(index, &index->elements, query->element)))
+      return 0;
+
+   if ((query->flags & XI_SPELL_QUERY_SKILL) && !(skill = spell_index_values(index, &index->skills, query->skill)))
+      return 0;
+
+   // jobs are merged word by word, so spells shared by jobs are counted once
+   size_t count = 0;
+   for (size_t w = 0; w < index->words; ++w) {
+      uint64_t bits = 0;
+      for (size_t r = 0; r < rows; ++r)
+         bits |= upper[r][w] & ~(lower[r] ? lower[r][w] : 0);
+
+      bits &= (element ? element[w] : ~(uint64_t)0);
+      bits &= (skill ? skill[w] : ~(uint64_t)0);
+
+      for (; bits; bits &= bits - 1) {
+         if (count < max)
+            out_spells[count] = w * 64 + lowest_bit(bits);
+         ++count;
+      }
+   }
+
+   return count;
+}
+
+const char*
+xi_archive_get_string(const struct xi_archive *archive, const uint32_t ref, size_t *out_length)
+{
+   assert(archive);
+
+   const struct xi_string_pool *pool = &archive->strings;
+   if ((size_t)ref + sizeof(uint16_t) > pool->size)
+      return NULL;
+
+   const uint8_t *entry = pool->data + ref;
+   const size_t length = entry[0] | (entry[1] << 8);
+   if ((size_t)ref + sizeof(uint16_t) + length + 1 > pool->size)
+      return NULL;
+
+   if (out_length)
+      *out_length = length;
+
+   return (const char*)entry + sizeof(uint16_t);
 }
 
 struct xi_ftable*
-xi_ftable_new(void)
+xi_ftable_new_with_allocator(const struct xi_allocator *allocator)
 {
    struct xi_ftable *ftable;
 
-   if (!(ftable = calloc(1, sizeof(struct xi_ftable))))
-      goto fail;
+   if (!allocator)
+      allocator = &xi_default_allocator;
 
-   if (!(ftable->data = chckIterPoolNew(30, 0, sizeof(struct xi_file_entry))))
-      goto fail;
+   if (!(ftable = xi_calloc(allocator, 1, sizeof(struct xi_ftable))))
+      return NULL;
 
+   ftable->allocator = *allocator;
+   array_init(&ftable->data, sizeof(struct xi_file_entry));
    return ftable;
+}
 
-fail:
-   if (ftable)
-      xi_ftable_free(ftable);
-   return NULL;
+struct xi_ftable*
+xi_ftable_new(void)
+{
+   return xi_ftable_new_with_allocator(NULL);
 }
 
 void
@@ -641,64 +1559,72 @@ xi_ftable_free(struct xi_ftable *ftable)
 {
    assert(ftable);
 
-   if (ftable->data)
-      chckIterPoolFree(ftable->data);
-
-   free(ftable);
+   const struct xi_allocator allocator = ftable->allocator;
+   array_release(&ftable->data, &allocator);
+   xi_free(&allocator, ftable);
 }
 
 struct xi_ftable*
-xi_ftable_load_from_memory(const void *f_data, const size_t f_size, const void *v_data, const size_t v_size)
+xi_ftable_load_from_memory_with_allocator(const void *f_data, const size_t f_size, const void *v_data, const size_t v_size, const struct xi_allocator *allocator)
 {
    assert(f_data && f_size && v_data && v_size);
 
    struct xi_ftable *ftable;
-   chckBuffer *buf[2] = { NULL, NULL };
-
-   if (!(ftable = xi_ftable_new()))
+   if (!(ftable = xi_ftable_new_with_allocator(allocator)))
       goto fail;
 
-   if (!(buf[0] = chckBufferNewFromPointer(f_data, f_size, CHCK_BUFFER_ENDIAN_LITTLE)) ||
-       !(buf[1] = chckBufferNewFromPointer(v_data, v_size, CHCK_BUFFER_ENDIAN_LITTLE)))
-      goto fail;
+   // ftable is uint16_t little endian id per file, vtable uint8_t exist per file
+   const uint8_t *f = f_data, *v = v_data;
+   struct xi_file_entry entry = {0};
+   for (size_t i = 0; i + 1 < f_size; i += 2) {
+      entry.id = f[i] | (f[i + 1] << 8);
+      entry.exist = (i / 2 < v_size ? v[i / 2] : entry.exist);
 
-   struct xi_file_entry entry;
-   while (chckBufferReadUInt16(buf[0], &entry.id)) {
-      chckBufferReadUInt8(buf[1], &entry.exist);
-      chckIterPoolAdd(ftable->data, &entry, NULL);
+      if (!array_add(&ftable->data, &ftable->allocator, &entry))
+         goto fail;
    }
 
-   for (int i = 0; i < 2; ++i)
-      chckBufferFree(buf[i]);
    return ftable;
 
 fail:
    if (ftable)
       xi_ftable_free(ftable);
-   for (int i = 0; i < 2; ++i)
-      if (buf[i])
-         chckBufferFree(buf[i]);
    return NULL;
 }
 
+struct xi_ftable*
+xi_ftable_load_from_memory(const void *f_data, const size_t f_size, const void *v_data, const size_t v_size)
+{
+   return xi_ftable_load_from_memory_with_allocator(f_data, f_size, v_data, v_size, NULL);
+}
+
 const struct xi_ftable*
-xi_ftable_load_from_file(const char *f_ftable, const char *f_vtable)
+xi_ftable_load_from_file_with_allocator(const char *f_ftable, const char *f_vtable, const struct xi_allocator *allocator)
 {
    assert(f_ftable && f_vtable);
 
+   if (!allocator)
+      allocator = &xi_default_allocator;
+
    size_t size[2];
    void *data[2] = { NULL, NULL };
-   if (!(data[0] = data_from_file(f_ftable, &size[0])) ||
-       !(data[1] = data_from_file(f_vtable, &size[1])))
+   if (!(data[0] = data_from_file(allocator, f_ftable, &size[0])) ||
+       !(data[1] = data_from_file(allocator, f_vtable, &size[1])))
       goto fail;
 
-   struct xi_ftable *ftable = xi_ftable_load_from_memory(data[0], size[0], data[1], size[1]);
+   struct xi_ftable *ftable = xi_ftable_load_from_memory_with_allocator(data[0], size[0], data[1], size[1], allocator);
    for (int i = 0; i < 2; ++i)
-      free(data[i]);
+      xi_free(allocator, data[i]);
    return ftable;
 
 fail:
    for (int i = 0; i < 2; ++i)
-      free(data[i]);
+      xi_free(allocator, data[i]);
    return NULL;
 }
+
+const struct xi_ftable*
+xi_ftable_load_from_file(const char *f_ftable, const char *f_vtable)
+{
+   return xi_ftable_load_from_file_with_allocator(f_ftable, f_vtable, NULL);
+}
@@ -52,6 +52,18 @@ enum xi_item_flags {
    XI_ITEM_EX = 0x6040,
 };
 
+/**
+ * Type specific data of item, the member of xi_item's payload union in use.
+ */
+enum xi_item_payload {
+   XI_ITEM_PAYLOAD_NONE,
+   XI_ITEM_PAYLOAD_WEAPON,
+   XI_ITEM_PAYLOAD_ARMOR,
+   XI_ITEM_PAYLOAD_PUPPET,
+   XI_ITEM_PAYLOAD_GENERAL,
+   XI_ITEM_PAYLOAD_USABLE,
+};
+
 enum xi_target_flags {
    XI_TARGET_SELF = 1<<0,
    XI_TARGET_PLAYER = 1<<1,
@@ -63,6 +75,66 @@ enum xi_target_flags {
    XI_TARGET_CORPSE = 1<<7,
 };
 
+/**
+ * Language of the text kept by compact archives.
+ */
+enum xi_language {
+   XI_LANGUAGE_ENGLISH,
+   XI_LANGUAGE_JAPANESE,
+};
+
+/**
+ * Flags for xi_load_options.
+ */
+enum xi_load_flags {
+   XI_LOAD_COMPACT = 1<<0, // abilities and spells are stored as compact records, see xi_archive_get_compact_*
+   XI_LOAD_UTF8 = 1<<1, // item strings and compact text are transcoded from Shift-JIS to UTF-8
+   XI_LOAD_PARALLEL = 1<<2, // fixed size records (items) are decoded and parsed on multiple threads
+   XI_LOAD_TYPE_HINT = 1<<3, // data is parsed as the type in options without detection, see xi_archive_detect_file
+};
+
+/**
+ * Item fields to parse, for xi_load_options.
+ * The header (id, flags, stack, type, resource, targets) is always parsed.
+ */
+enum xi_item_fields {
+   XI_ITEM_FIELDS_HEADER = 1<<0,
+   XI_ITEM_FIELDS_PAYLOAD = 1<<1, // type specific data (weapon, armor, ...)
+   XI_ITEM_FIELDS_NAME = 1<<2, // first string only
+   XI_ITEM_FIELDS_STRINGS = 1<<3, // all strings
+   XI_ITEM_FIELDS_ALL = 0xF,
+};
+
+/**
+ * Allocator for every libxi allocation, NULL allocator uses malloc, realloc and free.
+ * Objects built with an allocator copy it, userdata must outlive them.
+ * realloc and free are never called with NULL ptr.
+ * Must be thread safe when used with XI_LOAD_PARALLEL.
+ */
+struct xi_allocator {
+   void* (*alloc)(const size_t size, void *userdata);
+   void* (*realloc)(void *ptr, const size_t size, void *userdata);
+   void (*free)(void *ptr, void *userdata);
+   void *userdata;
+};
+
+/**
+ * Options for loading archives.
+ * Zero initialized options match the defaults of xi_archive_load_from_memory.
+ */
+struct xi_load_options {
+   uint32_t flags;
+   enum xi_language language; // text to keep in compact mode
+   uint32_t item_fields; // mask of xi_item_fields, 0 == XI_ITEM_FIELDS_ALL
+   unsigned int threads; // threads for XI_LOAD_PARALLEL, 0 == number of online cpus
+   enum xi_data_type type; // type of the data for XI_LOAD_TYPE_HINT
+   const struct xi_allocator *allocator; // copied by the archive, NULL == malloc
+
+   // resolves auto-translate phrases for XI_LOAD_UTF8, see xi_sjis_to_utf8
+   const char* (*autotranslate)(const uint32_t id, void *userdata);
+   void *userdata;
+};
+
 struct xi_string {
    char *data;
    size_t length;
@@ -113,6 +185,40 @@ struct xi_spell {
    char en_description[128];
 };
 
+/**
+ * Compact ability.
+ * Text fields are references to the archive's string pool, see xi_archive_get_string.
+ */
+struct xi_ability_compact {
+   uint32_t name;
+   uint32_t description;
+   uint16_t index;
+   uint16_t icon_id;
+   uint16_t mp_cost;
+   uint16_t unknown;
+   uint16_t targets;
+};
+
+/**
+ * Compact spell.
+ * Only text of the language selected at load time is kept.
+ */
+struct xi_spell_compact {
+   uint32_t name;
+   uint32_t description;
+   uint16_t index;
+   uint16_t type;
+   uint16_t element;
+   uint16_t targets;
+   uint16_t skill;
+   uint16_t mp_cost;
+   uint16_t id;
+   uint8_t casting_time;
+   uint8_t recast_delay;
+   uint8_t unknown;
+   uint8_t level[24];
+};
+
 struct xi_item_weapon {
    uint16_t level;
    uint16_t slots;
@@ -186,6 +292,50 @@ struct xi_item {
    uint32_t num_strings;
 };
 
+/**
+ * Header of pointer free archive image, see xi_archive_serialize.
+ * Offsets are relative to the start of the image.
+ */
+struct xi_store_header {
+   char magic[4]; // "XIST"
+   uint32_t version;
+   uint32_t type; // enum xi_data_type
+   uint32_t flags; // enum xi_store_flags
+   uint32_t count;
+   uint32_t record_size;
+   uint64_t records; // count * record_size bytes, struct xi_name_id, xi_ability(_compact), xi_spell(_compact) or xi_store_item
+   uint64_t strings; // string pool, entries are uint16_t length + bytes + \0
+   uint64_t strings_size;
+   uint64_t size;
+};
+
+enum xi_store_flags {
+   XI_STORE_COMPACT = 1<<0, // records are compact, string references are relative to the image's string pool
+};
+
+#define XI_STORE_NO_STRING 0xFFFFFFFF
+
+/**
+ * Item inside archive image.
+ */
+struct xi_store_item {
+   uint32_t id;
+   uint16_t flags;
+   uint16_t stack;
+   uint16_t type;
+   uint16_t resource;
+   uint16_t targets;
+   uint16_t padding;
+   uint32_t payload; // offset of struct xi_item_weapon, ..., 0 == none
+   uint32_t strings; // offset of struct xi_store_string[num_strings], 0 == none
+   uint32_t num_strings;
+};
+
+struct xi_store_string {
+   uint32_t ref; // string pool reference, XI_STORE_NO_STRING == none
+   uint32_t flags;
+};
+
 /**
  * Represents a type of data inside .dat archive.
  */
@@ -214,6 +364,9 @@ struct xi_ftable;
 struct xi_archive*
 xi_archive_new(void);
 
+struct xi_archive*
+xi_archive_new_with_allocator(const struct xi_allocator *allocator);
+
 void
 xi_archive_free(struct xi_archive *archive);
 
@@ -223,16 +376,338 @@ xi_archive_load_from_memory(const void *data, const size_t size);
 struct xi_archive*
 xi_archive_load_from_file(const char *file);
 
+struct xi_archive*
+xi_archive_load_from_memory_with_options(const void *data, const size_t size, const struct xi_load_options *options);
+
+struct xi_archive*
+xi_archive_load_from_file_with_options(const char *file, const struct xi_load_options *options);
+
+enum xi_data_type
+xi_archive_get_type(const struct xi_archive *archive);
+
+/**
+ * Detects type of the data without loading it.
+ * Only the first record is read, xi_archive_detect_file reads at most 0x400 bytes of the file.
+ */
+enum xi_data_type
+xi_archive_detect_memory(const void *data, const size_t size);
+
+enum xi_data_type
+xi_archive_detect_file(const char *file);
+
+/**
+ * Stable names of data types, "name-id", "ability", "spell", "item" and "unknown".
+ */
+const char*
+xi_data_type_to_string(const enum xi_data_type type);
+
+enum xi_data_type
+xi_data_type_from_string(const char *string);
+
+/**
+ * Returns bytes allocated for the archive's records, payloads and strings.
+ */
+size_t
+xi_archive_get_memory_usage(struct xi_archive *archive);
+
+/**
+ * Returns the allocator the archive was created with.
+ */
+const struct xi_allocator*
+xi_archive_get_allocator(const struct xi_archive *archive);
+
+/**
+ * Abilities and spells of archives loaded with XI_LOAD_COMPACT are not in this list.
+ */
 const struct xi_data*
 xi_archive_get_data_list(struct xi_archive *archive, size_t *out_count);
 
+const struct xi_ability_compact*
+xi_archive_get_compact_ability_list(struct xi_archive *archive, size_t *out_count);
+
+const struct xi_spell_compact*
+xi_archive_get_compact_spell_list(struct xi_archive *archive, size_t *out_count);
+
+/**
+ * Query of the spell learnability index, see xi_archive_query_spells.
+ * jobs is a mask of 1 << job, where job is the index to level of xi_spell.
+ */
+enum xi_spell_query_flags {
+   XI_SPELL_QUERY_ELEMENT = 1<<0, // only spells of the element
+   XI_SPELL_QUERY_SKILL = 1<<1, // only spells of the skill
+};
+
+struct xi_spell_query {
+   uint32_t flags;
+   uint32_t jobs;
+   uint8_t level_min, level_max;
+   uint16_t element, skill;
+};
+
+/**
+ * Finds spells learnable by any of the jobs at level_min..level_max (inclusive) without scanning the records.
+ * Index is built when spell archive is loaded.
+ * Writes at most max matching indices of the spell list (compact list with XI_LOAD_COMPACT) in ascending order.
+ * Returns the number of matching spells.
+ */
+size_t
+xi_archive_query_spells(const struct xi_archive *archive, const struct xi_spell_query *query, uint32_t *out_spells, const size_t max);
+
+/**
+ * Returns string from archive's string pool, NULL for invalid reference.
+ * Strings in the pool are \0 terminated.
+ */
+const char*
+xi_archive_get_string(const struct xi_archive *archive, const uint32_t ref, size_t *out_length);
+
+/**
+ * Returns payload used for item of type and flags.
+ */
+enum xi_item_payload
+xi_item_payload_type(const uint16_t type, const uint16_t flags);
+
+/**
+ * Returns sizeof the payload struct (xi_item_weapon, ...) used for item of type, 0 if none.
+ */
+size_t
+xi_item_payload_size(const uint16_t type, const uint16_t flags);
+
+/**
+ * Converts file id from file table into path relative to FFXI's install directory.
+ */
+void
+xi_id_to_path(const uint16_t id, char path[20]);
+
+struct xi_ftable*
+xi_ftable_new(void);
+
+struct xi_ftable*
+xi_ftable_new_with_allocator(const struct xi_allocator *allocator);
+
 void
 xi_ftable_free(struct xi_ftable *ftable);
 
 struct xi_ftable*
 xi_ftable_load_from_memory(const void *f_data, const size_t f_size, const void *v_data, const size_t v_size);
 
+struct xi_ftable*
+xi_ftable_load_from_memory_with_allocator(const void *f_data, const size_t f_size, const void *v_data, const size_t v_size, const struct xi_allocator *allocator);
+
 const struct xi_ftable*
 xi_ftable_load_from_file(const char *f_ftable, const char *f_vtable);
 
+const struct xi_ftable*
+xi_ftable_load_from_file_with_allocator(const char *f_ftable, const char *f_vtable, const struct xi_allocator *allocator);
+
+/**
+ * Represents a read-only archive image, shareable between processes.
+ */
+struct xi_store;
+
+/**
+ * Serializes archive into pointer free image, free with the archive's allocator.
+ */
+void*
+xi_archive_serialize(struct xi_archive *archive, size_t *out_size);
+
+/**
+ * Publishes archive into named POSIX shared memory segment, replacing previous one.
+ * Processes still attached to the previous segment keep it until they detach.
+ */
+int
+xi_store_publish(struct xi_archive *archive, const char *name);
+
+/**
+ * Publishes archive into sealed memfd, returns the fd or -1.
+ * Only available on Linux.
+ */
+int
+xi_store_publish_fd(struct xi_archive *archive);
+
+int
+xi_store_unlink(const char *name);
+
+struct xi_store*
+xi_store_attach(const char *name);
+
+struct xi_store*
+xi_store_attach_with_allocator(const char *name, const struct xi_allocator *allocator);
+
+struct xi_store*
+xi_store_attach_fd(const int fd);
+
+struct xi_store*
+xi_store_attach_fd_with_allocator(const int fd, const struct xi_allocator *allocator);
+
+/**
+ * Data must outlive the store.
+ */
+struct xi_store*
+xi_store_attach_memory(const void *data, const size_t size);
+
+struct xi_store*
+xi_store_attach_memory_with_allocator(const void *data, const size_t size, const struct xi_allocator *allocator);
+
+void
+xi_store_detach(struct xi_store *store);
+
+const struct xi_store_header*
+xi_store_get_header(const struct xi_store *store);
+
+const void*
+xi_store_get_record_list(const struct xi_store *store, size_t *out_count);
+
+const char*
+xi_store_get_string(const struct xi_store *store, const uint32_t ref, size_t *out_length);
+
+const void*
+xi_store_get_item_payload(const struct xi_store *store, const struct xi_store_item *item);
+
+const struct xi_store_string*
+xi_store_get_item_strings(const struct xi_store *store, const struct xi_store_item *item);
+
+/**
+ * Represents an immutable prefix index over names of archives.
+ */
+struct xi_name_index;
+
+#define XI_NAME_MAX 255
+
+struct xi_name_match {
+   uint32_t archive; // index to the archives the index was built from
+   uint32_t record; // index to the archive's data list, or compact list for compact abilities and spells
+   char name[XI_NAME_MAX + 1];
+};
+
+/**
+ * Indexes names of name-ids, abilities, spells (English) and items (first string).
+ * Names are front-coded in a flat image, which can be stored with xi_name_index_get_image.
+ * Archives are only needed while building.
+ */
+struct xi_name_index*
+xi_name_index_new(struct xi_archive **archives, const size_t count);
+
+struct xi_name_index*
+xi_name_index_new_with_allocator(struct xi_archive **archives, const size_t count, const struct xi_allocator *allocator);
+
+/**
+ * Data must outlive the index.
+ */
+struct xi_name_index*
+xi_name_index_attach_memory(const void *data, const size_t size);
+
+struct xi_name_index*
+xi_name_index_attach_memory_with_allocator(const void *data, const size_t size, const struct xi_allocator *allocator);
+
+void
+xi_name_index_free(struct xi_name_index *index);
+
+const void*
+xi_name_index_get_image(const struct xi_name_index *index, size_t *out_size);
+
+/**
+ * Finds names starting with prefix, ignoring ASCII case.
+ * Writes at most max matches in name order and returns the number written.
+ */
+size_t
+xi_name_index_find(const struct xi_name_index *index, const char *prefix, struct xi_name_match *out_matches, const size_t max);
+
+/**
+ * Represents name-ids of every zone merged into one table.
+ * Names are looked up by id, where zone is (id >> 12) & 0xFFF and entity id & 0xFFF.
+ * Zones 0..511 are kept, ids of higher zones are ignored.
+ */
+struct xi_zone_table;
+
+/**
+ * Merges name-id archives, other archives are ignored.
+ * Names are stored once, each zone keeps dense array over its entity range.
+ * Later archives replace names of ids found in earlier ones. Archives are only needed while building.
+ */
+struct xi_zone_table*
+xi_zone_table_new(struct xi_archive **archives, const size_t count);
+
+struct xi_zone_table*
+xi_zone_table_new_with_allocator(struct xi_archive **archives, const size_t count, const struct xi_allocator *allocator);
+
+void
+xi_zone_table_free(struct xi_zone_table *table);
+
+/**
+ * Returns \0 terminated name of the entity, NULL if there is none.
+ */
+const char*
+xi_zone_table_get_name(const struct xi_zone_table *table, const uint32_t id, size_t *out_length);
+
+/**
+ * Returns 0 if zone has no entities, ids of the zone are in first..first + count - 1.
+ */
+int
+xi_zone_table_get_range(const struct xi_zone_table *table, const uint16_t zone, uint16_t *out_first, uint16_t *out_count);
+
+size_t
+xi_zone_table_get_memory_usage(const struct xi_zone_table *table);
+
+/**
+ * Represents a thread safe, memory budgeted cache of loaded archives.
+ */
+struct xi_cache;
+
+struct xi_cache_stats {
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t coalesced; // gets that waited for another thread loading the same file
+   uint64_t evictions;
+   size_t bytes; // xi_archive_get_memory_usage of all cached archives
+   size_t budget;
+   size_t entries;
+};
+
+/**
+ * Unreferenced archives are evicted least recently used first while the cache is over budget.
+ * Root is the FFXI install directory for xi_cache_get_by_id, options are used for every load.
+ * The cache's own memory also comes from options->allocator.
+ */
+struct xi_cache*
+xi_cache_new(const size_t budget, const char *root, const struct xi_load_options *options);
+
+/**
+ * Frees every cached archive, including those still referenced.
+ */
+void
+xi_cache_free(struct xi_cache *cache);
+
+/**
+ * Returns referenced archive, loading it if needed, release with xi_cache_release.
+ * Concurrent gets of the same path share one load.
+ */
+struct xi_archive*
+xi_cache_get(struct xi_cache *cache, const char *path);
+
+struct xi_archive*
+xi_cache_get_by_id(struct xi_cache *cache, const uint16_t id);
+
+void
+xi_cache_release(struct xi_cache *cache, struct xi_archive *archive);
+
+/**
+ * Makes next get of path load it again, for files that changed on disk.
+ * Referenced archives stay valid until they are released.
+ */
+void
+xi_cache_invalidate(struct xi_cache *cache, const char *path);
+
+void
+xi_cache_get_stats(struct xi_cache *cache, struct xi_cache_stats *out_stats);
+
+/**
+ * Transcodes FFXI Shift-JIS text to UTF-8.
+ * Element symbols are written as their kanji, and auto-translate phrases as {phrase}.
+ * Phrases are resolved with the autotranslate callback, which may be NULL, unresolved phrases are written as {#id}.
+ * Output is \0 terminated and truncated at character boundary if out_size is too small.
+ * Returns the length of the full output, excluding \0.
+ */
+size_t
+xi_sjis_to_utf8(const char *data, const size_t length, char *out, const size_t out_size, const char* (*autotranslate)(const uint32_t id, void *userdata), void *userdata);
+
 #endif /* __LIBXI_H__ */
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "xi.h"
+#include "allocator.h"
+
+#define XI_ZONES 512
+#define XI_ZONE_NO_NAME 0xFFFFFFFF
+
+struct xi_zone {
+   uint16_t first, count; // entities first..first + count - 1
+   uint32_t offset; // of the zone's names in the table
+};
+
+struct xi_zone_table {
+   struct xi_allocator allocator;
+   struct xi_zone zones[XI_ZONES];
+
+   // name of every entity slot of every zone, offset into blob or XI_ZONE_NO_NAME
+   uint32_t *names;
+   size_t num_names;
+
+   // uint8_t length, bytes, \0 for every distinct name
+   uint8_t *blob;
+   size_t size, allocated;
+};
+
+struct dedup {
+   uint32_t *slots; // blob offset + 1, 0 == empty
+   size_t num_slots, used;
+};
+
+static inline uint16_t
+zone_of(const uint32_t id)
+{
+   // 12 bits below the entity type byte, only zones below XI_ZONES exist (Adoulin uses 0x100+)
+   return (id >> 12) & 0xFFF;
+}
+
+static inline uint16_t
+entity_of(const uint32_t id)
+{
+   return id & 0xFFF;
+}
+
+static size_t
+name_length(const struct xi_name_id *name_id)
+{
+   assert(name_id);
+
+   const char *end = memchr(name_id->name, 0, sizeof(name_id->name));
+   return (end ? (size_t)(end - name_id->name) : sizeof(name_id->name));
+}
+
+static size_t
+hash_name(const char *name, const size_t length)
+{
+   // FNV-1a
+   size_t hash = 2166136261u;
+   for (size_t i = 0; i < length; ++i)
+      hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+   return hash;
+}
+
+static bool
+blob_add(struct xi_zone_table *table, const char *name, const size_t length, uint32_t *out_offset)
+{
+   assert(table && name && length <= 0xFF && out_offset);
+
+   const size_t needed = table->size + 1 + length + 1;
+   if (needed >= XI_ZONE_NO_NAME)
+      return false;
+
+   if (needed > table->allocated) {
+      size_t allocated = (table->allocated > 0 ? table->allocated : 4096);
+      while (allocated < needed)
+         allocated *= 2;
+
+      void *tmp;
+      if (!(tmp = xi_realloc(&table->allocator, table->blob, allocated)))
+         return false;
+
+      table->blob = tmp;
+      table->allocated = allocated;
+   }
+
+   uint8_t *entry = table->blob + table->size;
+   entry[0] = length;
+   memcpy(entry + 1, name, length);
+   entry[1 + length] = 0;
+
+   *out_offset = table->size;
+   table->size = needed;
+   return true;
+}
+
+static bool
+dedup_grow(struct dedup *dedup, const struct xi_zone_table *table)
+{
+   assert(dedup && table);
+
+   // kept at most half full
+   if (dedup->used * 2 < dedup->num_slots)
+      return true;
+
+   uint32_t *slots;
+   const size_t num_slots = (dedup->num_slots ? dedup->num_slots * 2 : 1024);
+   if (!(slots = xi_calloc(&table->allocator, num_slots, sizeof(uint32_t))))
+      return false;
+
+   for (size_t i = 0; i < dedup->num_slots; ++i) {
+      if (!dedup->slots[i])
+         continue;
+
+      const uint8_t *entry = table->blob + dedup->slots[i] - 1;
+      size_t s = hash_name((const char*)entry + 1, entry[0]) & (num_slots - 1);
+      for (; slots[s]; s = (s + 1) & (num_slots - 1));
+      slots[s] = dedup->slots[i];
+   }
+
+   xi_free(&table->allocator, dedup->slots);
+   dedup->slots = slots;
+   dedup->num_slots = num_slots;
+   return true;
+}
+
+static bool
+dedup_add(struct dedup *dedup, struct xi_zone_table *table, const char *name, const size_t length, uint32_t *out_offset)
+{
+   assert(dedup && table && name && out_offset);
+
+   if (!dedup_grow(dedup, table))
+      return false;
+
+   size_t s = hash_name(name, length) & (dedup->num_slots - 1);
+   for (; dedup->slots[s]; s = (s + 1) & (dedup->num_slots - 1)) {
+      const uint8_t *entry = table->blob + dedup->slots[s] - 1;
+      if (entry[0] == length && !memcmp(entry + 1, name, length)) {
+         *out_offset = dedup->slots[s] - 1;
+         return true;
+      }
+   }
+
+   if (!blob_add(table, name, length, out_offset))
+      return false;
+
+   dedup->slots[s] = *out_offset + 1;
+   dedup->used += 1;
+   return true;
+}
+
+struct xi_zone_table*
+xi_zone_table_new_with_allocator(struct xi_archive **archives, const size_t count, const struct xi_allocator *allocator)
+{
+   assert(archives || !count);
+
+   if (!allocator)
+      allocator = &xi_default_allocator;
+
+   struct dedup dedup = {0};
+   struct xi_zone_table *table;
+
+   if (!(table = xi_calloc(allocator, 1, sizeof(struct xi_zone_table))))
+      goto fail;
+
+   table->allocator = *allocator;
+
+   // entity range of each zone
+   uint16_t last[XI_ZONES] = {0};
+   for (size_t a = 0; a < count; ++a) {
+      size_t num_data;
+      const struct xi_data *data = xi_archive_get_data_list(archives[a], &num_data);
+      for (size_t i = 0; i < num_data; ++i) {
+         if (data[i].type != XI_TYPE_NAME_ID || !data[i].name_id->id || zone_of(data[i].name_id->id) >= XI_ZONES)
+            continue;
+
+         const uint32_t id = data[i].name_id->id;
+         struct xi_zone *zone = &table->zones[zone_of(id)];
+
+         if (!zone->count) {
+            zone->first = last[zone_of(id)] = entity_of(id);
+            zone->count = 1;
+         } else {
+            zone->first = (entity_of(id) < zone->first ? entity_of(id) : zone->first);
+            last[zone_of(id)] = (entity_of(id) > last[zone_of(id)] ? entity_of(id) : last[zone_of(id)]);
+         }
+      }
+   }
+
+   for (unsigned int z = 0; z < XI_ZONES; ++z) {
+      struct xi_zone *zone = &table->zones[z];
+      zone->count = (zone->count ? last[z] - zone->first + 1 : 0);
+      zone->offset = table->num_names;
+      table->num_names += zone->count;
+   }
+
+   if (table->num_names > 0 && !(table->names = xi_calloc(allocator, table->num_names, sizeof(uint32_t))))
+      goto fail;
+
+   for (size_t i = 0; i < table->num_names; ++i)
+      table->names[i] = XI_ZONE_NO_NAME;
+
+   // later archives replace names of the same id
+   for (size_t a = 0; a < count; ++a) {
+      size_t num_data;
+      const struct xi_data *data = xi_archive_get_data_list(archives[a], &num_data);
+      for (size_t i = 0; i < num_data; ++i) {
+         if (data[i].type != XI_TYPE_NAME_ID || !data[i].name_id->id || zone_of(data[i].name_id->id) >= XI_ZONES)
+            continue;
+
+         const struct xi_name_id *name_id = data[i].name_id;
+         const struct xi_zone *zone = &table->zones[zone_of(name_id->id)];
+         uint32_t *name = &table->names[zone->offset + entity_of(name_id->id) - zone->first];
+
+         const size_t length = name_length(name_id);
+         if (!length) {
+            *name = XI_ZONE_NO_NAME;
+            continue;
+         }
+
+         if (!dedup_add(&dedup, table, name_id->name, length, name))
+            goto fail;
+      }
+   }
+
+   void *tmp;
+   if (table->size > 0 && (tmp = xi_realloc(allocator, table->blob, table->size))) {
+      table->blob = tmp;
+      table->allocated = table->size;
+   }
+
+   xi_free(allocator, dedup.slots);
+   return table;
+
+fail:
+   xi_free(allocator, dedup.slots);
+   if (table)
+      xi_zone_table_free(table);
+   return NULL;
+}
+
+struct xi_zone_table*
+xi_zone_table_new(struct xi_archive **archives, const size_t count)
+{
+   return xi_zone_table_new_with_allocator(archives, count, NULL);
+}
+
+void
+xi_zone_table_free(struct xi_zone_table *table)
+{
+   assert(table);
+   const struct xi_allocator allocator = table->allocator;
+   xi_free(&allocator, table->names);
+   xi_free(&allocator, table->blob);
+   xi_free(&allocator, table);
+}
+
+const char*
+xi_zone_table_get_name(const struct xi_zone_table *table, const uint32_t id, size_t *out_length)
+{
+   assert(table);
+
+   if (zone_of(id) >= XI_ZONES)
+      return NULL;
+
+   const struct xi_zone *zone = &table->zones[zone_of(id)];
+   const uint16_t entity = entity_of(id);
+   if (entity < zone->first || entity - zone->first >= zone->count)
+      return NULL;
+
+   const uint32_t offset = table->names[zone->offset + entity - zone->first];
+   if (offset == XI_ZONE_NO_NAME)
+      return NULL;
+
+   if (out_length)
+      *out_length = table->blob[offset];
+
+   return (const char*)table->blob + offset + 1;
+}
+
+int
+xi_zone_table_get_range(const struct xi_zone_table *table, const uint16_t zone, uint16_t *out_first, uint16_t *out_count)
+{
+   assert(table && out_first && out_count);
+
+   if (zone >= XI_ZONES) {
+      *out_first = *out_count = 0;
+      return 0;
+   }
+
+   *out_first = table->zones[zone].first;
+   *out_count = table->zones[zone].count;
+   return (*out_count > 0);
+}
+
+size_t
+xi_zone_table_get_memory_usage(const struct xi_zone_table *table)
+{
+   assert(table);
+   return sizeof(struct xi_zone_table) + table->num_names * sizeof(uint32_t) + table->allocated;
+}